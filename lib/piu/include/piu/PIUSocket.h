@@ -3,6 +3,20 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+
+// Bytes added by piu in front of every message on the wire
+#define PIU_HEADER_BYTES 13
+
+// Largest datagram in a 1500-byte MTU, without the IP and UDP headers.
+// Runs of datagrams of this size are handed to the kernel as one buffer
+// when it can segment them (UDP GSO), so layers cutting large messages
+// should cut them to this, headers included.
+#define PIU_SEGMENT_BYTES 1472
+
+// Datagrams read or written per system call, at most (recvmmsg/sendmmsg)
+#define PIU_DEFAULT_BATCH 32
+#define PIU_MAX_BATCH 64
 
 struct PIUSocket;
 typedef struct PIUSocket PIUSocket;
@@ -10,6 +24,27 @@ typedef struct PIUSocket PIUSocket;
 struct PIUServer;
 typedef struct PIUServer PIUServer;
 
+// Sending side of a connection
+typedef struct PIUStats {
+    uint32_t rtt_us;     // Smoothed round-trip time, 0 before the first sample
+    uint32_t min_rtt_us; // Smallest round-trip time seen
+
+    uint64_t sent;          // Data packets, first transmissions
+    uint64_t retransmitted; // Data packets sent again, a sign of loss
+
+    uint32_t queued;       // Data packets sent and not acknowledged yet
+    uint64_t queued_bytes;
+
+    // Batching: datagrams over system calls is the average batch
+    int batch_size;
+    uint64_t send_calls, send_datagrams; // Data of this socket
+    uint64_t recv_calls, recv_datagrams; // Of the loop, for every socket
+
+    // Kernel segmentation on send (UDP_SEGMENT) and coalescing on receive
+    // (UDP_GRO) are in use
+    bool gso, gro;
+} PIUStats;
+
 PIUSocket* piu_connect(char* addr, uint16_t port);
 PIUServer* piu_bind(uint16_t port);
 
@@ -17,10 +52,25 @@ PIUSocket* piu_accept(PIUServer* srv);
 
 char* piu_socket_addr(PIUSocket* skt);
 uint16_t piu_socket_port(PIUSocket* skt);
+void piu_socket_stats(PIUSocket* skt, PIUStats* stats);
+
+// While corked, sent messages are queued and written batch_size at a time;
+// uncorking writes the rest. Uncorked, every message is written right away.
+void piu_socket_cork(PIUSocket* skt, bool cork);
+
+// Sets the number of datagrams per system call, from 1 to PIU_MAX_BATCH.
+void piu_set_batch_size(int size);
 
 int piu_recv(PIUSocket* skt, void* buf, uint32_t size);
 bool piu_send(PIUSocket* skt, const void* buf, uint32_t size);
 
+// Scatter/gather variants: one message is read into, or built from, the
+// buffers in order. Extra message bytes past the buffers are dropped.
+// Receiving blocks until the next message and returns the bytes copied,
+// 0 for an empty message: there is no end of stream.
+int piu_recvv(PIUSocket* skt, const struct iovec* iov, int iovcnt);
+bool piu_sendv(PIUSocket* skt, const struct iovec* iov, int iovcnt);
+
 bool piu_main_loop();
 bool piu_stop_loop();
 
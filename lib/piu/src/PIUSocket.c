@@ -1,40 +1,96 @@
+#define _GNU_SOURCE // recvmmsg, sendmmsg
 #include "piu/PIUSocket.h"
 
 #include <arpa/inet.h>
 #include <malloc.h>
 #include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 #include <sys/epoll.h>
+#include <sys/random.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "internal/PIUBuff.h"
+#include "internal/PIUMap.h"
 #include "internal/log.h"
 
 #define SKT_MAX_PACKET 52768
+#define SKT_RECV_BYTES 65536 // A whole GRO train
 #define MAX_EPOLL_EVENTS 1024
-#define MAX_FILE_DESCRIPTORS 4096 // TODO: Check file descriptors
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 65000
 
 static int HELLO_TIMEOUT[] = {100, 100, 150, 150, 200, 200, 250, 250, 300, 300};
 
-struct PIUSocket {
+typedef union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+} SegmentControl;
+
+// Datagrams written together with sendmmsg. Their data must stay alive until
+// the batch is flushed; ACKs are kept in the batch itself.
+typedef struct Batch {
+    struct mmsghdr msgs[PIU_MAX_BATCH];
+    struct iovec iovs[PIU_MAX_BATCH];
+    char acks[PIU_MAX_BATCH][PKT_HEADER_BYTES];
+    int count;
+
+    // Messages actually written: runs of datagrams to the same address are
+    // merged into one, segmented by the kernel, with GSO
+    struct mmsghdr wire[PIU_MAX_BATCH];
+    int segments[PIU_MAX_BATCH];
+    SegmentControl control[PIU_MAX_BATCH];
+} Batch;
+
+// A UDP socket watched by the loop, with the piu sockets of every peer it
+// talks to. Bound ones also have a server; connected ones have one peer.
+typedef struct Endpoint {
     int fd;
+    pthread_mutex_t lock;
+
+    PIUServer* server; // Until closed
+    PIUMap peers;      // Sockets by addr_key(), accepted or not
+    bool writable;     // Watched for EPOLLOUT, as some socket has datagrams left
+    int users;         // Accepted sockets; closed at 0 once the server is too
+} Endpoint;
+
+struct PIUSocket {
+    Endpoint* ep;
 
     struct sockaddr_in addr;
     socklen_t addr_len;
+    uint32_t conn;
+    bool accepted; // Under the endpoint lock
 
     PIUBuff buf_read, buf_write;
     int read_id, write_id;
     pthread_cond_t data_ready;
 
-    PIUSocket *prev, *next;
+    PIUStats stats; // Under the buf_write lock
+
+    // Data and retransmissions not written yet, under the buf_write lock
+    Batch out;
+    bool corked;
+
+    PIUSocket* next; // In the queue of the server until accepted
 };
 
 struct PIUServer {
-    int fd;
+    Endpoint* ep;
 
     // Uncaptured sockets
     PIUSocket *head, *tail;
@@ -44,15 +100,25 @@ struct PIUServer {
 static pthread_t thread_id = 0;
 static int epollfd = -1;
 
-PIUSocket* socket_map[MAX_FILE_DESCRIPTORS];
-PIUServer* server_map[MAX_FILE_DESCRIPTORS];
-pthread_mutex_t fd_lock[MAX_FILE_DESCRIPTORS];
+static atomic_int batch_size = PIU_DEFAULT_BATCH;
+static atomic_uint_least64_t recv_calls, recv_datagrams;
+static atomic_bool gso_enabled, gro_enabled;
+
+static uint64_t monotonic_us() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
 
 static bool addrin_same(struct sockaddr_in* a, struct sockaddr_in* b) {
     return a->sin_addr.s_addr == b->sin_addr.s_addr &&
            a->sin_port == b->sin_port;
 }
 
+static uint64_t addr_key(const struct sockaddr_in* a) {
+    return (uint64_t)a->sin_addr.s_addr << 16 | a->sin_port;
+}
+
 char* piu_socket_addr(PIUSocket* skt) {
     return inet_ntoa(skt->addr.sin_addr);
 }
@@ -61,6 +127,311 @@ unsigned short piu_socket_port(PIUSocket* skt) {
     return ntohs(skt->addr.sin_port);
 }
 
+void piu_socket_stats(PIUSocket* skt, PIUStats* stats) {
+    piu_buff_lock(&skt->buf_write);
+    *stats = skt->stats;
+    piu_buff_unlock(&skt->buf_write);
+
+    stats->batch_size = atomic_load(&batch_size);
+    stats->recv_calls = atomic_load(&recv_calls);
+    stats->recv_datagrams = atomic_load(&recv_datagrams);
+    stats->gso = atomic_load(&gso_enabled);
+    stats->gro = atomic_load(&gro_enabled);
+}
+
+void piu_set_batch_size(int size) {
+    atomic_store(&batch_size, size < 1 ? 1 : size > PIU_MAX_BATCH ? PIU_MAX_BATCH : size);
+}
+
+// Number of datagrams from first that can go as one GSO buffer: same
+// address, and all of the size of the first but the last, which may be
+// shorter.
+static int batch_run(const Batch* b, int first) {
+    const struct msghdr* m = &b->msgs[first].msg_hdr;
+    size_t size = b->iovs[first].iov_len, total = size;
+
+    int i = first + 1;
+    while (i < b->count && i - first < GSO_MAX_SEGMENTS && b->iovs[i - 1].iov_len == size &&
+           b->iovs[i].iov_len <= size && total + b->iovs[i].iov_len <= GSO_MAX_BYTES &&
+           addrin_same(m->msg_name, b->msgs[i].msg_hdr.msg_name)) {
+        total += b->iovs[i].iov_len;
+        i++;
+    }
+    return i - first;
+}
+
+// Writes the datagrams from first, merged into runs if gso. Returns the
+// first one not written; errno tells why.
+static int batch_send(Batch* b, int fd, int first, bool gso, bool wait, PIUStats* stats) {
+    int count = 0;
+    for (int i = first; i < b->count; count++) {
+        int n = gso ? batch_run(b, i) : 1;
+
+        struct msghdr* m = &b->wire[count].msg_hdr;
+        *m = b->msgs[i].msg_hdr;
+        m->msg_iovlen = n;
+        if (n > 1) {
+            m->msg_control = b->control[count].buf;
+            m->msg_controllen = sizeof b->control[count].buf;
+
+            struct cmsghdr* cm = CMSG_FIRSTHDR(m);
+            cm->cmsg_level = IPPROTO_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t*)CMSG_DATA(cm) = b->iovs[i].iov_len;
+        }
+
+        b->segments[count] = n;
+        i += n;
+    }
+
+    int sent = 0;
+    while (sent < count) {
+        int n = sendmmsg(fd, b->wire + sent, count - sent, MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        for (int i = sent; i < sent + n; i++) {
+            first += b->segments[i];
+            if (stats != NULL)
+                stats->send_datagrams += b->segments[i];
+        }
+        sent += n;
+        if (stats != NULL)
+            stats->send_calls++;
+    }
+    return first;
+}
+
+// Writes the queued datagrams. If the kernel or the device cannot segment
+// them, GSO is turned off and they are written one by one. Unless wait, a
+// full socket buffer does not block: the datagrams left stay queued, and
+// false is returned. Datagrams the kernel refuses are dropped, and recovered
+// as lost ones.
+static bool batch_flush(Batch* b, int fd, bool wait, PIUStats* stats) {
+    bool gso = atomic_load(&gso_enabled);
+
+    int sent = batch_send(b, fd, 0, gso, wait, stats);
+    if (sent < b->count && gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+        LOGE("UDP GSO failed, falling back to plain datagrams");
+        atomic_store(&gso_enabled, false);
+        sent = batch_send(b, fd, sent, false, wait, stats);
+    }
+
+    if (sent < b->count && !wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        b->count -= sent;
+        memmove(b->msgs, b->msgs + sent, b->count * sizeof *b->msgs);
+        memmove(b->iovs, b->iovs + sent, b->count * sizeof *b->iovs);
+        for (int i = 0; i < b->count; i++)
+            b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        return false;
+    }
+    if (sent < b->count)
+        LOGE("sendmmsg");
+
+    b->count = 0;
+    return true;
+}
+
+// Drops the queued datagrams of data, about to be freed
+static void batch_forget(Batch* b, const void* data) {
+    int n = 0;
+    for (int i = 0; i < b->count; i++) {
+        if (b->iovs[i].iov_base == data)
+            continue;
+
+        b->msgs[n] = b->msgs[i];
+        b->iovs[n] = b->iovs[i];
+        b->msgs[n].msg_hdr.msg_iov = &b->iovs[n];
+        n++;
+    }
+    b->count = n;
+}
+
+// Returns false if the batch is full and, without wait, could not be written
+static bool batch_add(Batch* b, int fd, void* data, uint32_t size, struct sockaddr_in* addr, socklen_t addr_len,
+                      bool wait, PIUStats* stats) {
+    if (b->count >= atomic_load(&batch_size) && !batch_flush(b, fd, wait, stats) &&
+        b->count >= atomic_load(&batch_size))
+        return false;
+
+    int i = b->count++;
+    b->iovs[i] = (struct iovec){data, size};
+    b->msgs[i].msg_hdr = (struct msghdr){
+        .msg_name = addr,
+        .msg_namelen = addr_len,
+        .msg_iov = &b->iovs[i],
+        .msg_iovlen = 1,
+    };
+    return true;
+}
+
+// ACKs are written from the loop, which never waits on a full socket buffer:
+// those that do not fit are dropped, and the peer sends their packets again.
+static void batch_flush_acks(Batch* b, int fd) {
+    batch_flush(b, fd, false, NULL);
+    b->count = 0;
+}
+
+static void batch_add_ack(Batch* b, int fd, int id, uint32_t conn, struct sockaddr_in* addr, socklen_t addr_len) {
+    if (b->count >= atomic_load(&batch_size))
+        batch_flush_acks(b, fd);
+
+    PIUPacket ack;
+    piu_packet_init_in(&ack, b->acks[b->count], id, PIU_PKT_ACK, conn, NULL, 0);
+    batch_add(b, fd, ack.data, ack.size, addr, addr_len, false, NULL);
+}
+
+// GSO is probed on the first socket; GRO is asked for on every one, and the
+// kernel coalesces nothing on those it refused it.
+static void enable_offloads(int fd) {
+    static atomic_flag probed = ATOMIC_FLAG_INIT;
+    int on = 1, off = 0;
+
+    if (!atomic_flag_test_and_set(&probed))
+        atomic_store(&gso_enabled, setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &off, sizeof off) == 0);
+    if (setsockopt(fd, IPPROTO_UDP, UDP_GRO, &on, sizeof on) == 0)
+        atomic_store(&gro_enabled, true);
+}
+
+static Endpoint* endpoint_new(int fd) {
+    Endpoint* ep = malloc(sizeof(Endpoint));
+    ep->fd = fd;
+    pthread_mutex_init(&ep->lock, NULL);
+    ep->server = NULL;
+    piu_map_init(&ep->peers);
+    ep->writable = false;
+    ep->users = 0;
+    return ep;
+}
+
+// The loop sees the endpoint from now on
+static bool endpoint_watch(Endpoint* ep) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = ep;
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, ep->fd, &ev) == -1) {
+        LOGE("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+// Under the endpoint lock
+static void endpoint_want_write(Endpoint* ep, bool want) {
+    if (ep->writable == want)
+        return;
+
+    struct epoll_event ev;
+    ev.events = want ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = ep;
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, ep->fd, &ev) == -1) {
+        LOGE("epoll_ctl");
+        return;
+    }
+    ep->writable = want;
+}
+
+// Writes what the sockets of the endpoint had left once it is writable
+static void endpoint_drain(Endpoint* ep) {
+    pthread_mutex_lock(&ep->lock);
+
+    bool left = false;
+    for (uint32_t i = 0; ep->peers.slots && i <= ep->peers.mask; i++) {
+        PIUSocket* skt = ep->peers.slots[i].value;
+        if (skt == NULL)
+            continue;
+
+        piu_buff_lock(&skt->buf_write);
+        if (skt->out.count > 0 && !skt->corked && !batch_flush(&skt->out, ep->fd, false, &skt->stats))
+            left = true;
+        piu_buff_unlock(&skt->buf_write);
+    }
+    endpoint_want_write(ep, left);
+
+    pthread_mutex_unlock(&ep->lock);
+}
+
+static void endpoint_free(Endpoint* ep) {
+    pthread_mutex_destroy(&ep->lock);
+    piu_map_free(&ep->peers);
+    close(ep->fd);
+    free(ep);
+}
+
+// Releases the lock of the endpoint, and the endpoint itself once nothing
+// uses it
+static void endpoint_unlock(Endpoint* ep) {
+    if (ep->users > 0 || ep->server != NULL) {
+        pthread_mutex_unlock(&ep->lock);
+        return;
+    }
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, ep->fd, NULL) == -1) {
+        LOGE("epollfd");
+    }
+    pthread_mutex_unlock(&ep->lock);
+    endpoint_free(ep);
+}
+
+// The socket of the peer at addr, if the packet is of its connection. Under
+// the endpoint lock.
+static PIUSocket* endpoint_peer(Endpoint* ep, const struct sockaddr_in* addr, uint32_t conn) {
+    PIUSocket* skt = piu_map_get(&ep->peers, addr_key(addr));
+    return skt != NULL && skt->conn == conn ? skt : NULL;
+}
+
+static uint32_t new_conn() {
+    uint32_t conn;
+    if (getrandom(&conn, sizeof conn, 0) != sizeof conn)
+        conn = monotonic_us();
+    return conn != 0 ? conn : 1;
+}
+
+static PIUSocket* socket_new(Endpoint* ep, const struct sockaddr_in* addr, socklen_t addr_len, uint32_t conn) {
+    PIUSocket* skt = malloc(sizeof(PIUSocket));
+    skt->ep = ep;
+    memcpy(&skt->addr, addr, addr_len);
+    skt->addr_len = addr_len;
+    skt->conn = conn;
+    skt->accepted = false;
+
+    piu_buff_init(&skt->buf_read);
+    piu_buff_init(&skt->buf_write);
+    skt->read_id = skt->write_id = 0;
+    memset(&skt->stats, 0, sizeof skt->stats);
+    skt->out.count = 0;
+    skt->corked = false;
+    pthread_cond_init(&skt->data_ready, NULL);
+    skt->next = NULL;
+    return skt;
+}
+
+static void socket_free(PIUSocket* skt) {
+    piu_buff_free(&skt->buf_read);
+    piu_buff_free(&skt->buf_write);
+    pthread_cond_destroy(&skt->data_ready);
+    free(skt);
+}
+
+static void send_hello_ack(int fd, uint32_t conn, struct sockaddr_in* addr, socklen_t addr_len) {
+    char buf[PKT_HEADER_BYTES];
+    PIUPacket ack;
+    piu_packet_init_in(&ack, buf, PIU_PKT_HELLO_ID, PIU_PKT_ACK, conn, NULL, 0);
+    piu_packet_sendto(fd, &ack, (struct sockaddr*)addr, addr_len);
+}
+
+void piu_socket_cork(PIUSocket* skt, bool cork) {
+    piu_buff_lock(&skt->buf_write);
+    skt->corked = cork;
+    if (!cork)
+        batch_flush(&skt->out, skt->ep->fd, true, &skt->stats);
+    piu_buff_unlock(&skt->buf_write);
+}
+
 PIUSocket* piu_connect(char* addr, uint16_t port) {
     struct sockaddr_in server;
 
@@ -69,6 +440,7 @@ PIUSocket* piu_connect(char* addr, uint16_t port) {
         LOGE("socket");
         return NULL;
     }
+    enable_offloads(fd);
 
     memset(&server, 0, sizeof server);
     server.sin_family = AF_INET;
@@ -76,7 +448,7 @@ PIUSocket* piu_connect(char* addr, uint16_t port) {
     server.sin_port = htons(port);
 
     PIUPacket pkt;
-    piu_packet_init(&pkt, PIU_PKT_HELLO_ID, PIU_PKT_HELLO, NULL, 0);
+    piu_packet_init(&pkt, PIU_PKT_HELLO_ID, PIU_PKT_HELLO, 0, NULL, 0);
 
     struct pollfd pollfd; // TODO: Use a better method to prevent hanging on
     pollfd.fd = fd;
@@ -85,6 +457,7 @@ PIUSocket* piu_connect(char* addr, uint16_t port) {
     char buf[256];
 
     bool connection_estabilished = false;
+    uint32_t conn = 0;
     for (int i = 0; i < sizeof(HELLO_TIMEOUT) / sizeof(*HELLO_TIMEOUT); i++) {
         int x = piu_packet_sendto(fd, &pkt, (struct sockaddr*)&server, sizeof(server));
 
@@ -112,15 +485,14 @@ PIUSocket* piu_connect(char* addr, uint16_t port) {
         }
 
         PIUPacket ack;
-        if (!piu_packet_parse(&ack, buf, recvaddr_len))
+        if (!piu_packet_parse(&ack, buf, r))
             continue;
 
         if (ack.type == PIU_PKT_ACK && ack.id == pkt.id) {
+            conn = ack.conn;
             connection_estabilished = true;
-            piu_packet_free(&ack);
             break;
         }
-        piu_packet_free(&ack);
     }
 
     piu_packet_free(&pkt);
@@ -132,33 +504,18 @@ PIUSocket* piu_connect(char* addr, uint16_t port) {
         return NULL;
     }
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = fd;
-
-    PIUSocket* skt = malloc(sizeof(PIUSocket));
-    socket_map[fd] = skt;
-    pthread_mutex_init(&fd_lock[fd], NULL);
+    // Ready before the loop can see it: the peer may send right away
+    Endpoint* ep = endpoint_new(fd);
+    PIUSocket* skt = socket_new(ep, &server, sizeof(server), conn);
+    skt->accepted = true;
+    ep->users = 1;
 
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-        LOGE("epoll_ctl");
-        socket_map[fd] = NULL;
-        pthread_mutex_destroy(&fd_lock[fd]);
-        free(skt);
-        close(fd);
+    if (!piu_map_put(&ep->peers, addr_key(&server), skt) || !endpoint_watch(ep)) {
+        socket_free(skt);
+        endpoint_free(ep);
         return NULL;
     }
 
-    memcpy(&skt->addr, &server, sizeof(server));
-    skt->addr_len = sizeof(server);
-
-    skt->fd = fd;
-    piu_buff_init(&skt->buf_read);
-    piu_buff_init(&skt->buf_write);
-    skt->prev = skt->next = NULL;
-    skt->read_id = skt->write_id = 0;
-    pthread_cond_init(&skt->data_ready, NULL);
-
     return skt;
 }
 
@@ -170,6 +527,7 @@ PIUServer* piu_bind(uint16_t port) {
         LOGE("socket");
         return NULL;
     }
+    enable_offloads(fd);
 
     memset(&server, 0, sizeof server);
     server.sin_family = AF_INET;
@@ -182,100 +540,102 @@ PIUServer* piu_bind(uint16_t port) {
         return NULL;
     }
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = fd;
-
+    Endpoint* ep = endpoint_new(fd);
     PIUServer* srv = malloc(sizeof(PIUServer));
-    server_map[fd] = srv;
-    pthread_mutex_init(&fd_lock[fd], NULL);
+    srv->ep = ep;
+    srv->head = srv->tail = NULL;
+    pthread_cond_init(&srv->cond, NULL);
+    ep->server = srv;
 
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-        LOGE("epoll_ctl");
-        server_map[fd] = NULL;
-        pthread_mutex_destroy(&fd_lock[fd]);
+    if (!endpoint_watch(ep)) {
+        pthread_cond_destroy(&srv->cond);
         free(srv);
-        close(fd);
+        endpoint_free(ep);
         return NULL;
     }
 
-    srv->fd = fd;
-    srv->head = srv->tail = NULL;
-    pthread_cond_init(&srv->cond, NULL);
     return srv;
 }
 
-inline static int skt_sendto(PIUSocket* skt, const PIUPacket* pkt) {
-    return piu_packet_sendto(skt->fd, pkt, (struct sockaddr*)&skt->addr, skt->addr_len);
+// Queues a data packet of buf_write, under its lock. The loop does not wait
+// for room, and may have to leave the packet out.
+inline static bool skt_queue(PIUSocket* skt, PIUPacket* pkt, bool wait) {
+    return batch_add(&skt->out, skt->ep->fd, pkt->data, pkt->size, &skt->addr, skt->addr_len, wait, &skt->stats);
 }
 
-static bool handle_hello(int fd, struct sockaddr_in* addr, socklen_t addr_len) {
-    pthread_mutex_lock(&fd_lock[fd]);
-    PIUServer* srv = server_map[fd];
+// A hello from a new address makes a socket for the server to accept; one
+// from a known address is a retransmission, answered again once accepted.
+// Peers are told apart by address only here, as hellos carry no connection
+// ID yet: a client restarting on the same address and port while its old
+// socket is open gets the old connection back, and the server sees its
+// packets on that socket.
+static bool handle_hello(Endpoint* ep, struct sockaddr_in* addr, socklen_t addr_len) {
+    pthread_mutex_lock(&ep->lock);
+    PIUServer* srv = ep->server;
 
     if (srv == NULL) {
-        pthread_mutex_unlock(&fd_lock[fd]);
+        pthread_mutex_unlock(&ep->lock);
         return false;
     }
 
-    // Retransmission
-    for (PIUSocket *p = socket_map[fd]; p != NULL; p = p->prev) {
-        if (addrin_same(&p->addr, addr)) {
-            pthread_mutex_unlock(&fd_lock[fd]);
-
-            PIUPacket ack;
-            piu_packet_init(&ack, PIU_PKT_HELLO_ID, PIU_PKT_ACK, NULL, 0);
+    PIUSocket* skt = piu_map_get(&ep->peers, addr_key(addr));
+    if (skt != NULL) {
+        if (skt->accepted)
+            send_hello_ack(ep->fd, skt->conn, addr, addr_len);
 
-            skt_sendto(p, &ack);
-
-            piu_packet_free(&ack);
-            return true;
-        }
+        pthread_mutex_unlock(&ep->lock);
+        return true;
     }
 
-    PIUSocket *skt = malloc(sizeof(PIUSocket));
-    skt->fd = srv->fd;
-    skt->addr_len = addr_len;
-    skt->prev = skt->next = NULL;
-    memcpy(&skt->addr, addr, skt->addr_len);
+    skt = socket_new(ep, addr, addr_len, new_conn());
+    if (!piu_map_put(&ep->peers, addr_key(addr), skt)) {
+        pthread_mutex_unlock(&ep->lock);
+        socket_free(skt);
+        return false;
+    }
 
     if (srv->tail == NULL) {
         srv->tail = srv->head = skt;
     } else {
         srv->tail->next = skt;
-        skt->prev = srv->tail;
-
         srv->tail = skt;
     }
 
     pthread_cond_signal(&srv->cond);
-    pthread_mutex_unlock(&fd_lock[fd]);
+    pthread_mutex_unlock(&ep->lock);
     return true;
 }
 
-static bool handle_data(int fd, const PIUPacket* pkt, struct sockaddr_in* addr, socklen_t addr_len) {
-    pthread_mutex_lock(&fd_lock[fd]);
+static bool handle_data(Endpoint* ep, const PIUPacket* pkt, struct sockaddr_in* addr, socklen_t addr_len,
+                        Batch* acks) {
+    pthread_mutex_lock(&ep->lock);
 
-    PIUSocket* skt = NULL;
-    for (PIUSocket *p = socket_map[fd]; p != NULL; p = p->prev) {
-        if (addrin_same(&p->addr, addr)) {
-            skt = p;
-            break;
-        }
+    PIUSocket* skt = endpoint_peer(ep, addr, pkt->conn);
+    if (skt == NULL) {
+        pthread_mutex_unlock(&ep->lock);
+        return false;
     }
 
-    if (skt == NULL) {
-        pthread_mutex_unlock(&fd_lock[fd]);
+    piu_buff_lock(&skt->buf_read);
+
+    // Not acknowledged: a sane peer never gets this far ahead, and growing
+    // the window for it would take any amount of memory
+    if (piu_buff_beyond(&skt->buf_read, pkt->id)) {
+        piu_buff_unlock(&skt->buf_read);
+        pthread_mutex_unlock(&ep->lock);
         return false;
     }
 
-    PIUPacket ack;
-    piu_packet_init(&ack, pkt->id, PIU_PKT_ACK, NULL, 0);
-    skt_sendto(skt, &ack);
-    piu_packet_free(&ack);
+    batch_add_ack(acks, ep->fd, pkt->id, skt->conn, addr, addr_len);
 
-    piu_buff_lock(&skt->buf_read);
-    PIUPacket* pkt_r = piu_buff_push_id(&skt->buf_read, pkt->id);
+    // Retransmission of a packet already read
+    if (pkt->id < skt->read_id) {
+        piu_buff_unlock(&skt->buf_read);
+        pthread_mutex_unlock(&ep->lock);
+        return true;
+    }
+
+    PIUPacket* pkt_r = piu_buff_push_id(&skt->buf_read, pkt->id, pkt->size);
     if (pkt_r != NULL) {
         piu_packet_copy(pkt_r, pkt);
         
@@ -284,117 +644,134 @@ static bool handle_data(int fd, const PIUPacket* pkt, struct sockaddr_in* addr,
     }
     piu_buff_unlock(&skt->buf_read);
 
-    pthread_mutex_unlock(&fd_lock[fd]);
+    pthread_mutex_unlock(&ep->lock);
     return true;
 }
 
-static bool handle_ack(int fd, const PIUPacket* pkt, struct sockaddr_in* addr, socklen_t addr_len) {
+static bool handle_ack(Endpoint* ep, const PIUPacket* pkt, struct sockaddr_in* addr, socklen_t addr_len) {
     if (pkt->id == PIU_PKT_HELLO_ID) // Hello ACK
         return true;
 
-    pthread_mutex_lock(&fd_lock[fd]);
-
-    PIUSocket* skt = NULL;
-    for (PIUSocket *p = socket_map[fd]; p != NULL; p = p->prev) {
-        if (addrin_same(&p->addr, addr)) {
-            skt = p;
-            break;
-        }
-    }
+    pthread_mutex_lock(&ep->lock);
 
+    PIUSocket* skt = endpoint_peer(ep, addr, pkt->conn);
     if (skt == NULL) {
-        pthread_mutex_unlock(&fd_lock[fd]);
+        pthread_mutex_unlock(&ep->lock);
         return false;
     }
 
     int id = pkt->id;
+    PIUBuff* buf = &skt->buf_write;
 
-    piu_buff_lock(&skt->buf_write);
+    piu_buff_lock(buf);
 
-    PIUBuffNode* p = skt->buf_write.tail;
-    if (!p || p->pkt.id > id) // Already ACK
+    PIUPacket* p = piu_buff_get(buf, id);
+    if (p == NULL) { // Already ACK
+        piu_buff_unlock(buf);
+        pthread_mutex_unlock(&ep->lock);
         return true;
+    }
 
-    while (p->pkt.id != id) {
-        if (!p->pkt.was_ack) {
-            if (p->next->pkt.id != id)
-                skt_sendto(skt, &p->pkt);
+    // Older packets are resent, but the one right before, which may just be
+    // reordered
+    for (int i = buf->tail; i < id - 1; i++) {
+        PIUPacket* q = piu_buff_get(buf, i);
+        if (!q->was_ack && skt_queue(skt, q, false)) {
+            q->was_resent = true;
+            skt->stats.retransmitted++;
         }
-
-        p = p->next;
     }
 
-    p->pkt.was_ack = true;
+    // Only packets sent once give an unambiguous round-trip (Karn)
+    if (!p->was_ack && !p->was_resent) {
+        uint32_t rtt = monotonic_us() - p->sent_us;
+        PIUStats* st = &skt->stats;
+
+        st->rtt_us = st->rtt_us == 0 ? rtt : (7 * (uint64_t)st->rtt_us + rtt) / 8;
+        if (st->min_rtt_us == 0 || rtt < st->min_rtt_us)
+            st->min_rtt_us = rtt;
+    }
+    p->was_ack = true;
 
     // Clearing already acknowledge packets
-    while (skt->buf_write.tail && skt->buf_write.tail->pkt.was_ack)
-        piu_buff_pop(&skt->buf_write);
+    while ((p = piu_buff_get(buf, buf->tail)) != NULL && p->was_ack) {
+        skt->stats.queued--;
+        skt->stats.queued_bytes -= p->payload_len;
+        batch_forget(&skt->out, p->data);
+        piu_buff_pop(buf);
+    }
 
-    piu_buff_unlock(&skt->buf_write);
+    // Not while corked, which the sender lifts with a flush of its own
+    if (!skt->corked && !batch_flush(&skt->out, ep->fd, false, &skt->stats))
+        endpoint_want_write(ep, true);
 
-    pthread_mutex_unlock(&fd_lock[fd]);
+    piu_buff_unlock(buf);
+
+    pthread_mutex_unlock(&ep->lock);
     return true;
 }
 
 PIUSocket* piu_accept(PIUServer* srv) {
-    pthread_mutex_lock(&fd_lock[srv->fd]);
+    Endpoint* ep = srv->ep;
+
+    pthread_mutex_lock(&ep->lock);
     PIUSocket* skt = srv->head;
     if (skt == NULL) {
-        pthread_cond_wait(&srv->cond, &fd_lock[srv->fd]);
+        pthread_cond_wait(&srv->cond, &ep->lock);
         skt = srv->head;
         if (skt == NULL) {
-            pthread_mutex_unlock(&fd_lock[srv->fd]);
+            pthread_mutex_unlock(&ep->lock);
             return NULL;
         }
     }
     srv->head = srv->head->next;
     if (srv->head == NULL)
         srv->tail = NULL;
-    pthread_mutex_unlock(&fd_lock[srv->fd]);
 
-    piu_buff_init(&skt->buf_read);
-    piu_buff_init(&skt->buf_write);
-    skt->read_id = skt->write_id = 0;
-    pthread_cond_init(&skt->data_ready, NULL);
+    skt->next = NULL;
+    skt->accepted = true;
+    ep->users++;
 
-    PIUPacket ack;
-    piu_packet_init(&ack, PIU_PKT_HELLO_ID, PIU_PKT_ACK, NULL, 0);
-
-    skt_sendto(skt, &ack);
-
-    if (socket_map[skt->fd] == NULL) {
-        skt->prev = skt->next = NULL;
-        socket_map[skt->fd] = skt;
-    } else {
-        socket_map[skt->fd]->next = skt;
-        skt->prev = socket_map[skt->fd];
-        skt->next = NULL;
-    }
-    piu_packet_free(&ack);
+    send_hello_ack(ep->fd, skt->conn, &skt->addr, skt->addr_len);
+    pthread_mutex_unlock(&ep->lock);
 
     return skt;
 }
 
-int piu_recv(PIUSocket* skt, void* buf, uint32_t size) {
+int piu_recvv(PIUSocket* skt, const struct iovec* iov, int iovcnt) {
     piu_buff_lock(&skt->buf_read);
-    if (!skt->buf_read.tail || skt->buf_read.tail->pkt.id > skt->read_id) {
+
+    PIUPacket* pkt;
+    while ((pkt = piu_buff_get(&skt->buf_read, skt->read_id)) == NULL) {
         pthread_cond_wait(&skt->data_ready, &skt->buf_read.lock);
     }
 
-    PIUPacket* pkt = &skt->buf_read.tail->pkt;
+    uint32_t copied = 0;
+    for (int i = 0; i < iovcnt && copied < pkt->payload_len; i++) {
+        uint32_t size = iov[i].iov_len;
+        if (size > pkt->payload_len - copied)
+            size = pkt->payload_len - copied;
 
-    if (size > pkt->payload_len)
-        size = pkt->payload_len;
-
-    memcpy(buf, pkt->payload, size);
+        memcpy(iov[i].iov_base, pkt->payload + copied, size);
+        copied += size;
+    }
     piu_buff_pop(&skt->buf_read);
 
     skt->read_id++;
     piu_buff_unlock(&skt->buf_read);
-    return size;
+    return copied;
 }
 
-bool piu_send(PIUSocket* skt, const void* buf, uint32_t size) {
+int piu_recv(PIUSocket* skt, void* buf, uint32_t size) {
+    struct iovec iov = {buf, size};
+    return piu_recvv(skt, &iov, 1);
+}
+
+bool piu_sendv(PIUSocket* skt, const struct iovec* iov, int iovcnt) {
+    uint32_t size = 0;
+    for (int i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+
     if (size > SKT_MAX_PACKET) {
         LOG("packet too big: %u", size);
         return false;
@@ -402,23 +779,87 @@ bool piu_send(PIUSocket* skt, const void* buf, uint32_t size) {
 
     piu_buff_lock(&skt->buf_write);
 
-    PIUPacket* pkt = piu_buff_push(&skt->buf_write);
+    PIUPacket* pkt = piu_buff_push(&skt->buf_write, PKT_HEADER_BYTES + size);
     if (pkt == NULL) {
         LOG("failed to push packet!");
+        piu_buff_unlock(&skt->buf_write);
         return false;
     }
 
-    piu_packet_init(pkt, skt->write_id++, PIU_PKT_DATA, buf, size);
-    skt_sendto(skt, pkt);
+    // Gathered straight into the packet, which keeps it for retransmission
+    piu_packet_init_in(pkt, pkt->data, skt->write_id++, PIU_PKT_DATA, skt->conn, NULL, size);
+    char* p = pkt->payload;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    pkt->sent_us = monotonic_us();
+    skt_queue(skt, pkt, true);
+    if (!skt->corked)
+        batch_flush(&skt->out, skt->ep->fd, true, &skt->stats);
+
+    skt->stats.sent++;
+    skt->stats.queued++;
+    skt->stats.queued_bytes += size;
 
     piu_buff_unlock(&skt->buf_write);
 
     return true;
 }
 
+bool piu_send(PIUSocket* skt, const void* buf, uint32_t size) {
+    struct iovec iov = {(void*)buf, size};
+    return piu_sendv(skt, &iov, 1);
+}
+
+static void handle_packet(Endpoint* ep, char* buf, int size, struct sockaddr_in* addr, socklen_t addr_len,
+                          Batch* acks) {
+    // Parsed in place; data packets are copied into their buffer
+    PIUPacket pkt;
+    if (!piu_packet_parse(&pkt, buf, size)) {
+        LOG("Failed to parse packet!");
+        return;
+    }
+
+    switch (pkt.type) {
+    case PIU_PKT_HELLO:
+        handle_hello(ep, addr, addr_len);
+        break;
+    case PIU_PKT_DATA:
+        handle_data(ep, &pkt, addr, addr_len, acks);
+        break;
+    case PIU_PKT_ACK:
+        handle_ack(ep, &pkt, addr, addr_len);
+        break;
+    default:
+        LOG("invalid packet type");
+        break;
+    }
+}
+
+// Size of the datagrams the kernel coalesced into a message with GRO, or 0
+static int gro_segment(struct msghdr* m) {
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(m); cm != NULL; cm = CMSG_NXTHDR(m, cm)) {
+        if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO)
+            return *(int*)CMSG_DATA(cm);
+    }
+    return 0;
+}
+
+// Each ready fd is drained batch_size messages at a time, and the ACKs of a
+// batch are written together once it is handled. A message may hold several
+// datagrams with GRO; they are split back here.
 static void* main_loop() {
     struct epoll_event events[MAX_EPOLL_EVENTS];
-    static char buf[SKT_MAX_PACKET];
+    static char bufs[PIU_MAX_BATCH][SKT_RECV_BYTES];
+    static struct mmsghdr msgs[PIU_MAX_BATCH];
+    static struct iovec iovs[PIU_MAX_BATCH];
+    static struct sockaddr_in addrs[PIU_MAX_BATCH];
+    static union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } controls[PIU_MAX_BATCH];
+    static Batch acks;
 
     for (;;) {
         int n = epoll_wait(epollfd, events, MAX_EPOLL_EVENTS, -1);
@@ -428,41 +869,49 @@ static void* main_loop() {
         }
 
         for (int i = 0; i < n; i++) {
-            int fd = events[i].data.fd;
-
-            struct sockaddr_in srvinfo;
-            socklen_t srvinfo_len = sizeof(srvinfo);
-
-            int size = recvfrom(fd, buf, SKT_MAX_PACKET, 0,
-                                (struct sockaddr*)&srvinfo, &srvinfo_len);
-            if (size < 0) {
-                LOGE("recvfrom");
-                continue;
-            }
-
-            // If skt != NULL, then a connection already exists
-            PIUPacket pkt;
-            if (!piu_packet_parse(&pkt, buf, size)) {
-                LOG("Failed to parse packet!");
-                continue;
-            }
-
-            switch (pkt.type) {
-            case PIU_PKT_HELLO:
-                handle_hello(fd, &srvinfo, srvinfo_len);
-                break;
-            case PIU_PKT_DATA:
-                handle_data(fd, &pkt, &srvinfo, srvinfo_len);
-                break;
-            case PIU_PKT_ACK:
-                handle_ack(fd, &pkt, &srvinfo, srvinfo_len);
-                break;
-            default:
-                LOG("invalid packet type");
-                break;
-            }
-
-            piu_packet_free(&pkt);
+            Endpoint* ep = events[i].data.ptr;
+            int batch = atomic_load(&batch_size);
+            int count;
+
+            if (events[i].events & EPOLLOUT)
+                endpoint_drain(ep);
+
+            do {
+                for (int j = 0; j < batch; j++) {
+                    iovs[j] = (struct iovec){bufs[j], SKT_RECV_BYTES};
+                    msgs[j].msg_hdr = (struct msghdr){
+                        .msg_name = &addrs[j],
+                        .msg_namelen = sizeof addrs[j],
+                        .msg_iov = &iovs[j],
+                        .msg_iovlen = 1,
+                        .msg_control = controls[j].buf,
+                        .msg_controllen = sizeof controls[j].buf,
+                    };
+                }
+
+                count = recvmmsg(ep->fd, msgs, batch, MSG_DONTWAIT, NULL);
+                if (count < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        LOGE("recvmmsg");
+                    break;
+                }
+                atomic_fetch_add(&recv_calls, 1);
+
+                int datagrams = 0;
+                for (int j = 0; j < count; j++) {
+                    int len = msgs[j].msg_len;
+                    int segment = gro_segment(&msgs[j].msg_hdr);
+                    if (segment <= 0)
+                        segment = len;
+
+                    for (int off = 0; off < len; off += segment, datagrams++) {
+                        int size = len - off < segment ? len - off : segment;
+                        handle_packet(ep, bufs[j] + off, size, &addrs[j], msgs[j].msg_hdr.msg_namelen, &acks);
+                    }
+                }
+                atomic_fetch_add(&recv_datagrams, datagrams);
+                batch_flush_acks(&acks, ep->fd);
+            } while (count == batch);
         }
     }
     return NULL;
@@ -518,57 +967,35 @@ void piu_close_socket(PIUSocket* skt) { // TODO: Socket closing
     if (skt == NULL)
         return;
 
-    pthread_mutex_lock(&fd_lock[skt->fd]);
-
-    if (skt->next == NULL) {
-        socket_map[skt->fd] = skt->prev;
-        if (skt->prev) skt->prev->next = NULL;
-    } else {
-        if (skt->prev) skt->prev->next = skt->next;
-        skt->next->prev = skt->prev;
-    }
-
-    int fd = skt->fd;
-    piu_buff_free(&skt->buf_read);
-    piu_buff_free(&skt->buf_write);
-    pthread_cond_destroy(&skt->data_ready);
-    free(skt);
-
-    if (socket_map[fd] == NULL && server_map[fd] == NULL) {
-        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
-            LOGE("epollfd");
-        }
+    Endpoint* ep = skt->ep;
+    pthread_mutex_lock(&ep->lock);
 
-        close(fd);
-    }
+    piu_map_remove(&ep->peers, addr_key(&skt->addr));
+    socket_free(skt);
 
-    pthread_mutex_unlock(&fd_lock[fd]);
+    ep->users--;
+    endpoint_unlock(ep);
 }
 
 void piu_close_server(PIUServer* srv) {
     if (srv == NULL)
         return;
-    pthread_mutex_lock(&fd_lock[srv->fd]);
-
-    int fd = srv->fd;
-    PIUSocket* head = srv->head;
 
-    pthread_cond_destroy(&srv->cond);
-    free(srv);
+    Endpoint* ep = srv->ep;
+    pthread_mutex_lock(&ep->lock);
 
-    if (socket_map[fd] == NULL && server_map[fd] == NULL) {
-        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
-            LOGE("epollfd");
-        }
+    // Never accepted
+    while (srv->head != NULL) {
+        PIUSocket* tmp = srv->head;
+        srv->head = tmp->next;
 
-        close(fd);
+        piu_map_remove(&ep->peers, addr_key(&tmp->addr));
+        socket_free(tmp);
     }
 
-    pthread_mutex_unlock(&fd_lock[fd]);
+    pthread_cond_destroy(&srv->cond);
+    free(srv);
 
-    while (head != NULL) {
-        PIUSocket *tmp = head;
-        head = head->next;
-        free(tmp);
-    }
+    ep->server = NULL;
+    endpoint_unlock(ep);
 }
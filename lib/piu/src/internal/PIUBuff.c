@@ -6,90 +6,92 @@
 #include <malloc.h>
 
 void piu_buff_init(PIUBuff *buf) {
-    buf->head = buf->tail = NULL;
+    buf->slots = NULL;
+    buf->mask = 0;
+    buf->tail = buf->head = 0;
+    piu_pool_init(&buf->pool);
     pthread_mutex_init(&buf->lock, NULL);
 }
 
-PIUPacket *piu_buff_push(PIUBuff *buf) {
-    PIUBuffNode *node = malloc(sizeof(PIUBuffNode));
-    node->next = NULL;
+// Makes room for ids up to id, moving the window to the larger slots
+static bool piu_buff_grow(PIUBuff *buf, int id) {
+    uint32_t size = buf->slots ? buf->mask + 1 : PIU_BUFF_MIN_SLOTS;
+    while ((uint32_t)(id - buf->tail) >= size)
+        size *= 2;
 
-    if (buf->head == NULL) {
-        buf->head = buf->tail = node;
-    } else {
-        buf->head->next = node;
-        buf->head = node;
+    if (buf->slots && size == buf->mask + 1)
+        return true;
+
+    PIUPacket *slots = calloc(size, sizeof *slots);
+    if (slots == NULL) {
+        LOG("failed to grow buffer to %u packets", size);
+        return false;
     }
 
-    memset(&node->pkt, 0, sizeof node->pkt);
-    return &node->pkt;
+    for (int i = buf->tail; i < buf->head; i++)
+        slots[i & (size - 1)] = buf->slots[i & buf->mask];
+
+    free(buf->slots);
+    buf->slots = slots;
+    buf->mask = size - 1;
+    return true;
 }
 
-PIUPacket *piu_buff_push_id(PIUBuff *buf, int id) {
-    PIUBuffNode *node = malloc(sizeof(PIUBuffNode));
-    node->next = NULL;
+PIUPacket *piu_buff_push(PIUBuff *buf, uint32_t size) {
+    return piu_buff_push_id(buf, buf->head, size);
+}
 
-    if (buf->head == NULL) {
-        buf->head = buf->tail = node;
-    } else if (buf->tail->pkt.id == id || buf->head->pkt.id == id) {
-        free(node);
+PIUPacket *piu_buff_push_id(PIUBuff *buf, int id, uint32_t size) {
+    if (id < buf->tail || piu_buff_beyond(buf, id))
         return NULL;
-    } else if (buf->tail->pkt.id > id) {
-        node->next = buf->tail;
-        buf->tail = node;
-    } else if (buf->head->pkt.id < id) {
-        buf->head->next = node;
-        buf->head = node;
-    } else {
-        PIUBuffNode* p = buf->tail;
-        while (p->next && p->next->pkt.id < id)
-            p = p->next;
-
-        if (!p->next) {
-            LOG("buff packet not ordered: %d", id);
-            p = buf->tail;
-            while (p != NULL) {
-                fprintf(stderr, "%d ", p->pkt.id);
-                p = p->next;
-            }
-            fprintf(stderr, "\n");
-            abort();
-        }
-
-        if (p->next->pkt.id == id) {
-            free(node);
-            return NULL;
-        }
 
-        node->next = p->next;
-        p->next = node;
+    if (!buf->slots || (uint32_t)(id - buf->tail) > buf->mask) {
+        if (!piu_buff_grow(buf, id))
+            return NULL;
     }
 
-    memset(&node->pkt, 0, sizeof node->pkt);
-    return &node->pkt;
+    PIUPacket *pkt = &buf->slots[id & buf->mask];
+    if (pkt->data != NULL)
+        return NULL;
+
+    memset(pkt, 0, sizeof *pkt);
+    pkt->data = piu_pool_alloc(&buf->pool, size);
+    if (pkt->data == NULL)
+        return NULL;
+    pkt->size = size;
+    pkt->pool = &buf->pool;
+
+    if (id >= buf->head)
+        buf->head = id + 1;
+    return pkt;
+}
+
+PIUPacket *piu_buff_get(PIUBuff *buf, int id) {
+    if (id < buf->tail || id >= buf->head)
+        return NULL;
+
+    PIUPacket *pkt = &buf->slots[id & buf->mask];
+    return pkt->data != NULL ? pkt : NULL;
 }
 
 void piu_buff_pop(PIUBuff *buf) {
-    if (buf->tail == NULL)
+    if (buf->tail == buf->head)
         return;
 
-    PIUBuffNode *node = buf->tail;
-    buf->tail = buf->tail->next;
-    if (buf->tail == NULL)
-        buf->head = NULL;
-
-    piu_packet_free(&node->pkt);
-    free(node);
+    PIUPacket *pkt = &buf->slots[buf->tail & buf->mask];
+    if (pkt->data != NULL) {
+        piu_packet_free(pkt);
+        pkt->data = NULL;
+    }
+    buf->tail++;
 }
 
 void piu_buff_free(PIUBuff *buf) {
-    PIUBuffNode *p = buf->tail;
-    while (p != NULL) {
-        PIUBuffNode *tmp = p;
-        p = p->next;
+    while (buf->tail != buf->head)
+        piu_buff_pop(buf);
 
-        piu_packet_free(&tmp->pkt);
-        free(tmp);
-    }
+    free(buf->slots);
+    buf->slots = NULL;
+    piu_pool_destroy(&buf->pool);
     pthread_mutex_destroy(&buf->lock);
 }
@@ -4,25 +4,49 @@
 #include "PIUPacket.h"
 #include <pthread.h>
 
-typedef struct PIUBuffNode PIUBuffNode;
-struct PIUBuffNode {
-    PIUPacket pkt;
+#define PIU_BUFF_MIN_SLOTS 256   // A power of two
+#define PIU_BUFF_MAX_SLOTS 65536 // Ids this far past tail are never taken
+
+// Window of packets by id: ids [tail, head) are in the window, and the
+// packet of an id is in slot id & mask, so inserting, finding duplicates and
+// popping in order are O(1). A slot with no data is a packet not received
+// yet. The slots double whenever an id falls past the end of the window, up
+// to PIU_BUFF_MAX_SLOTS.
+// Packet memory comes from the pool of the buffer.
+typedef struct PIUBuff {
+    PIUPacket* slots;
+    uint32_t mask;
+    int tail, head;
 
-    PIUBuffNode *next;
-};
+    PIUPool pool;
 
-typedef struct PIUBuff {
-    PIUBuffNode *tail, *head;
     pthread_mutex_t lock;
 } PIUBuff;
 
 void piu_buff_init(PIUBuff *buf);
-PIUPacket* piu_buff_push(PIUBuff *buf);
-PIUPacket* piu_buff_push_id(PIUBuff *buf, int id);
+
+// Returns the packet to fill in at head, with size bytes of data, or NULL if
+// out of memory.
+PIUPacket* piu_buff_push(PIUBuff *buf, uint32_t size);
+
+// Returns the packet to fill in for id, with size bytes of data, or NULL if
+// it is already in the buffer, popped or beyond the window (or out of
+// memory).
+PIUPacket* piu_buff_push_id(PIUBuff *buf, int id, uint32_t size);
+
+// Returns the packet of id, or NULL if it is not in the buffer.
+PIUPacket* piu_buff_get(PIUBuff *buf, int id);
+
+// Frees the packet at tail, if any, and moves the window past it.
 void piu_buff_pop(PIUBuff *buf);
 
 void piu_buff_free(PIUBuff *buf);
 
+// True if id is too far past tail to ever be pushed
+static inline bool piu_buff_beyond(const PIUBuff *buf, int id) {
+    return (int64_t)id - buf->tail >= PIU_BUFF_MAX_SLOTS;
+}
+
 static inline int piu_buff_lock(PIUBuff *buf) {
     return pthread_mutex_lock(&buf->lock);
 }
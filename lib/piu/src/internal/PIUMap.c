@@ -0,0 +1,101 @@
+#include "PIUMap.h"
+
+#include "log.h"
+#include <stdlib.h>
+
+// Fibonacci hashing: the multiplication spreads keys that differ only in a
+// few bits, like ports of one address, and the high bits are folded down.
+static inline uint32_t piu_map_hash(const PIUMap *map, uint64_t key) {
+    uint64_t h = key * 0x9e3779b97f4a7c15ull;
+    return (h ^ h >> 32) & map->mask;
+}
+
+void piu_map_init(PIUMap *map) {
+    map->slots = NULL;
+    map->mask = 0;
+    map->count = 0;
+}
+
+static PIUMapSlot *piu_map_find(const PIUMap *map, uint64_t key) {
+    if (map->slots == NULL)
+        return NULL;
+
+    for (uint32_t i = piu_map_hash(map, key);; i = (i + 1) & map->mask) {
+        PIUMapSlot *slot = &map->slots[i];
+        if (slot->value == NULL || slot->key == key)
+            return slot;
+    }
+}
+
+static bool piu_map_grow(PIUMap *map) {
+    uint32_t size = map->slots ? 2 * (map->mask + 1) : PIU_MAP_MIN_SLOTS;
+
+    PIUMapSlot *slots = calloc(size, sizeof *slots);
+    if (slots == NULL) {
+        LOG("failed to grow map to %u slots", size);
+        return false;
+    }
+
+    PIUMap old = *map;
+    map->slots = slots;
+    map->mask = size - 1;
+
+    for (uint32_t i = 0; old.slots && i <= old.mask; i++) {
+        if (old.slots[i].value != NULL)
+            *piu_map_find(map, old.slots[i].key) = old.slots[i];
+    }
+
+    free(old.slots);
+    return true;
+}
+
+void *piu_map_get(const PIUMap *map, uint64_t key) {
+    PIUMapSlot *slot = piu_map_find(map, key);
+    return slot ? slot->value : NULL;
+}
+
+bool piu_map_put(PIUMap *map, uint64_t key, void *value) {
+    PIUMapSlot *slot = piu_map_find(map, key);
+    if (slot != NULL && slot->value != NULL) {
+        slot->value = value;
+        return true;
+    }
+
+    if (2 * (map->count + 1) > map->mask + 1) {
+        if (!piu_map_grow(map))
+            return false;
+        slot = piu_map_find(map, key);
+    }
+
+    slot->key = key;
+    slot->value = value;
+    map->count++;
+    return true;
+}
+
+void *piu_map_remove(PIUMap *map, uint64_t key) {
+    PIUMapSlot *slot = piu_map_find(map, key);
+    if (slot == NULL || slot->value == NULL)
+        return NULL;
+
+    void *value = slot->value;
+    map->count--;
+
+    // Later keys of the run are moved back into the hole, unless it lies
+    // before their hash, so every key stays reachable without tombstones
+    uint32_t hole = slot - map->slots;
+    for (uint32_t i = (hole + 1) & map->mask; map->slots[i].value != NULL; i = (i + 1) & map->mask) {
+        uint32_t home = piu_map_hash(map, map->slots[i].key);
+        if (((i - home) & map->mask) >= ((i - hole) & map->mask)) {
+            map->slots[hole] = map->slots[i];
+            hole = i;
+        }
+    }
+    map->slots[hole].value = NULL;
+    return value;
+}
+
+void piu_map_free(PIUMap *map) {
+    free(map->slots);
+    piu_map_init(map);
+}
@@ -0,0 +1,38 @@
+#ifndef _PIU_INTERNAL_PIUMAP_H
+#define _PIU_INTERNAL_PIUMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PIU_MAP_MIN_SLOTS 16 // A power of two
+
+typedef struct PIUMapSlot {
+    uint64_t key;
+    void *value; // NULL if the slot is free
+} PIUMapSlot;
+
+// Hash table from 64-bit keys to non-NULL pointers, with open addressing:
+// a key lives in the first free slot from its hash on, so a lookup is a
+// short run of one array. The slots double when half full. Not thread-safe:
+// each map is used under the lock of its owner.
+typedef struct PIUMap {
+    PIUMapSlot *slots;
+    uint32_t mask;
+    uint32_t count;
+} PIUMap;
+
+void piu_map_init(PIUMap *map);
+
+// Returns the value of key, or NULL if it is not in the map.
+void *piu_map_get(const PIUMap *map, uint64_t key);
+
+// Sets the value of key, replacing any previous one. Returns false if out of
+// memory.
+bool piu_map_put(PIUMap *map, uint64_t key, void *value);
+
+// Removes key, returning its value, or NULL if it was not in the map.
+void *piu_map_remove(PIUMap *map, uint64_t key);
+
+void piu_map_free(PIUMap *map);
+
+#endif
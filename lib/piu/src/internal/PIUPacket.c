@@ -7,22 +7,32 @@
 #define PTR_U8(x) ((uint8_t*)(x))
 #define PTR_U32(x) ((uint32_t*)(x))
 
-void piu_packet_init(PIUPacket* pkt, int id, uint8_t type, const void* payload, uint32_t payload_len) {
+void piu_packet_init(PIUPacket* pkt, int id, uint8_t type, uint32_t conn, const void* payload,
+                     uint32_t payload_len) {
+    piu_packet_init_in(pkt, malloc(PKT_HEADER_BYTES + payload_len), id, type, conn, payload, payload_len);
+    pkt->pool = NULL;
+}
+
+void piu_packet_init_in(PIUPacket* pkt, void* data, int id, uint8_t type, uint32_t conn, const void* payload,
+                        uint32_t payload_len) {
     // Header
     pkt->id = id;
     pkt->type = type;
+    pkt->conn = conn;
     pkt->payload_len = payload_len;
 
     pkt->size = PKT_HEADER_BYTES + payload_len;
-    pkt->data = malloc(pkt->size);
+    pkt->data = data;
 
     pkt->payload = pkt->data + PKT_HEADER_BYTES;
 
     *PTR_U32(pkt->data) = htonl(id);
     *PTR_U8(pkt->data + 4) = type;
-    *PTR_U32(pkt->data + 5) = htonl(payload_len);
+    *PTR_U32(pkt->data + 5) = htonl(conn);
+    *PTR_U32(pkt->data + 9) = htonl(payload_len);
 
-    if (payload_len > 0)
+    // A NULL payload is left for the caller to fill
+    if (payload != NULL && payload_len > 0)
         memcpy(pkt->payload, payload, payload_len);
 }
 
@@ -30,13 +40,18 @@ bool piu_packet_parse(PIUPacket* pkt, void* data, uint32_t size) {
     if (size < PKT_HEADER_BYTES)
         return false;
 
-    pkt->data = malloc(size);
+    pkt->data = data;
     pkt->size = size;
-    memcpy(pkt->data, data, size);
 
     pkt->id = ntohl(*PTR_U32(pkt->data));
     pkt->type = *PTR_U8(pkt->data + 4);
-    pkt->payload_len = ntohl(*PTR_U32(pkt->data + 5)); // TODO: Ensure payload_len is right
+    pkt->conn = ntohl(*PTR_U32(pkt->data + 5));
+    pkt->payload_len = ntohl(*PTR_U32(pkt->data + 9));
+
+    // Truncated, or a length made up by the peer: the payload is read from
+    // here on, and the datagram holds no more than size bytes
+    if ((uint32_t)pkt->payload_len > size - PKT_HEADER_BYTES)
+        return false;
 
     pkt->payload = pkt->data + PKT_HEADER_BYTES;
     return true;
@@ -46,8 +61,8 @@ void piu_packet_copy(PIUPacket* dst, const PIUPacket* src) {
     dst->size = src->size;
     dst->id = src->id;
     dst->type = src->type;
+    dst->conn = src->conn;
 
-    dst->data = malloc(dst->size);
     memcpy(dst->data, src->data, dst->size);
 
     dst->payload = dst->data + PKT_HEADER_BYTES;
@@ -57,5 +72,8 @@ void piu_packet_copy(PIUPacket* dst, const PIUPacket* src) {
 }
 
 void piu_packet_free(PIUPacket *pkt) {
-    free(pkt->data);
+    if (pkt->pool != NULL)
+        piu_pool_free(pkt->pool, pkt->data, pkt->size);
+    else
+        free(pkt->data);
 }
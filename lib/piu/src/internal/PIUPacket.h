@@ -5,19 +5,26 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdint.h>
+#include "piu/PIUSocket.h"
+#include "PIUPool.h"
 
 #define PKT_MAX_BYTES 32768
-#define PKT_HEADER_BYTES 9
+#define PKT_HEADER_BYTES PIU_HEADER_BYTES
 
 #define PIU_PKT_HELLO_ID 0x7fffffff
 
 enum { PIU_PKT_DATA, PIU_PKT_ACK, PIU_PKT_HELLO };
 
-// Header (9) = ID (4) + Type (1) + Length (4)
+// Header (13) = ID (4) + Type (1) + Connection (4) + Length (4)
+//
+// The connection ID is given by the server in the ACK of the hello, and
+// both ends send every later packet with it, so packets of an earlier
+// connection from the same address are told apart. Hellos carry 0.
 typedef struct PIUPacket {
     // Packet structure
     int id;
     uint8_t type;
+    uint32_t conn;
     int payload_len;
     char* payload;
 
@@ -27,10 +34,24 @@ typedef struct PIUPacket {
 
     // Local-only members
     bool was_ack; // Only for PIU_PKT_DATA
+    bool was_resent;
+    uint64_t sent_us; // First transmission
+    PIUPool* pool;    // Owner of data, or NULL if malloc'd
 } PIUPacket;
 
-void piu_packet_init(PIUPacket* pkt, int id, uint8_t type, const void* payload, uint32_t payload_len);
+void piu_packet_init(PIUPacket* pkt, int id, uint8_t type, uint32_t conn, const void* payload,
+                     uint32_t payload_len);
+
+// Same as piu_packet_init, in PKT_HEADER_BYTES + payload_len bytes of data
+// owned by the caller (e.g. on the stack), so it must not be freed.
+void piu_packet_init_in(PIUPacket* pkt, void* data, int id, uint8_t type, uint32_t conn, const void* payload,
+                        uint32_t payload_len);
+
+// Parses the packet in place: it points into data, and must not be freed.
+// Returns false if the header is cut or the payload does not fit in size.
 bool piu_packet_parse(PIUPacket* pkt, void* data, uint32_t size);
+
+// Copies src into dst, whose data must already hold src->size bytes.
 void piu_packet_copy(PIUPacket* dst, const PIUPacket* src);
 void piu_packet_free(PIUPacket *pkt);
 
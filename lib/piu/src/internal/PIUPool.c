@@ -0,0 +1,41 @@
+#include "PIUPool.h"
+
+#include <stdlib.h>
+
+void piu_pool_init(PIUPool *pool) {
+    pool->free = NULL;
+    pool->count = 0;
+}
+
+void *piu_pool_alloc(PIUPool *pool, uint32_t size) {
+    if (size > PIU_POOL_BLOCK_SIZE)
+        return malloc(size);
+
+    void *block = pool->free;
+    if (block == NULL)
+        return malloc(PIU_POOL_BLOCK_SIZE);
+
+    pool->free = *(void**)block;
+    pool->count--;
+    return block;
+}
+
+void piu_pool_free(PIUPool *pool, void *data, uint32_t size) {
+    if (size > PIU_POOL_BLOCK_SIZE || pool->count == PIU_POOL_MAX_FREE) {
+        free(data);
+        return;
+    }
+
+    *(void**)data = pool->free;
+    pool->free = data;
+    pool->count++;
+}
+
+void piu_pool_destroy(PIUPool *pool) {
+    while (pool->free != NULL) {
+        void *block = pool->free;
+        pool->free = *(void**)block;
+        free(block);
+    }
+    pool->count = 0;
+}
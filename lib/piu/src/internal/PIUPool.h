@@ -0,0 +1,29 @@
+#ifndef _PIU_INTERNAL_PIUPOOL_H
+#define _PIU_INTERNAL_PIUPOOL_H
+
+#include <stdint.h>
+#include "piu/PIUSocket.h"
+
+#define PIU_POOL_BLOCK_SIZE PIU_SEGMENT_BYTES
+
+// Free blocks kept past this are given back to the system
+#define PIU_POOL_MAX_FREE 512
+
+// Fixed-size packet memory. Freed blocks are reused last in, first out, so
+// they are still in cache, and once warm the pool allocates nothing. Not
+// thread-safe: each pool is used under the lock of its owner.
+typedef struct PIUPool {
+    void *free; // Linked through the first bytes of each block
+    int count;
+} PIUPool;
+
+void piu_pool_init(PIUPool *pool);
+
+// Returns size bytes, from the pool if they fit in a block, or NULL if out
+// of memory.
+void *piu_pool_alloc(PIUPool *pool, uint32_t size);
+void piu_pool_free(PIUPool *pool, void *data, uint32_t size);
+
+void piu_pool_destroy(PIUPool *pool);
+
+#endif
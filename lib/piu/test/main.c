@@ -4,7 +4,10 @@
 #include <string.h>
 #include "piu/PIUSocket.h"
 
+#include "modules/buff_test.h"
 #include "modules/loss_test.h"
+#include "modules/map_test.h"
+#include "modules/packet_test.h"
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -37,6 +40,8 @@ void* func(void* ptr) {
 }
 
 int main() {
+    if (piu_buff_test(0) != 0 || piu_map_test(0) != 0 || piu_packet_test() != 0)
+        return 1;
     return piu_ping_test(8888, 100, 10);
     piu_main_loop();
 
@@ -0,0 +1,72 @@
+#include "buff_test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "check.h"
+#include "internal/PIUBuff.h"
+
+#define DEFAULT_NUM_PACKETS 10000
+
+// Pushes the ids in a random order, each twice, while popping whatever is
+// in order, as the read side of a socket does under loss and reordering.
+int piu_buff_test(int num_packets) {
+    if (num_packets == 0)
+        num_packets = DEFAULT_NUM_PACKETS;
+
+    int* ids = malloc(2 * num_packets * sizeof(int));
+    for (int i = 0; i < num_packets; i++)
+        ids[2 * i] = ids[2 * i + 1] = i;
+
+    // Shuffled, but an id is never more than a few hundred places away
+    srand(time(0));
+    for (int i = 2 * num_packets - 1; i > 0; i--) {
+        int j = i - rand() % (i < 500 ? i + 1 : 500);
+        int tmp = ids[i];
+        ids[i] = ids[j];
+        ids[j] = tmp;
+    }
+
+    PIUBuff buf;
+    piu_buff_init(&buf);
+
+    int ret = 0;
+    int next = 0, duplicates = 0;
+    for (int i = 0; i < 2 * num_packets; i++) {
+        PIUPacket* pkt = piu_buff_push_id(&buf, ids[i], PKT_HEADER_BYTES + sizeof(int));
+        if (pkt == NULL) {
+            duplicates++;
+            continue;
+        }
+        piu_packet_init_in(pkt, pkt->data, ids[i], PIU_PKT_DATA, 0, &ids[i], sizeof(int));
+
+        while ((pkt = piu_buff_get(&buf, next)) != NULL) {
+            int id;
+            memcpy(&id, pkt->payload, sizeof id);
+            CHECK(pkt->id == next && id == next, "popped %d (payload %d), expected %d", pkt->id, id, next);
+
+            piu_buff_pop(&buf);
+            next++;
+        }
+    }
+
+    CHECK(next == num_packets, "popped %d/%d packets", next, num_packets);
+    CHECK(duplicates == num_packets, "found %d/%d duplicates", duplicates, num_packets);
+
+    // Past the largest window, the id is refused without growing the slots
+    uint32_t slots = buf.mask + 1;
+    CHECK(piu_buff_push_id(&buf, buf.tail + PIU_BUFF_MAX_SLOTS, PKT_HEADER_BYTES) == NULL,
+          "pushed id %d past the window", buf.tail + PIU_BUFF_MAX_SLOTS);
+    CHECK(piu_buff_push_id(&buf, 0x7fffffff - 1, PKT_HEADER_BYTES) == NULL, "pushed id %d past the window",
+          0x7fffffff - 1);
+    CHECK(buf.mask + 1 == slots, "slots grew from %u to %u", slots, buf.mask + 1);
+
+    printf("Buffer: %d packets in order, %d duplicates dropped, %u slots\n", next, duplicates, buf.mask + 1);
+
+stop:
+    piu_buff_free(&buf);
+    free(ids);
+    return ret;
+}
@@ -0,0 +1,6 @@
+#ifndef _PIU_TEST_MODULE_BUFF_TEST_H
+#define _PIU_TEST_MODULE_BUFF_TEST_H
+
+int piu_buff_test(int num_packets);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _PIU_TEST_MODULE_CHECK_H
+#define _PIU_TEST_MODULE_CHECK_H
+
+#include <stdio.h>
+
+// Both expect an int ret and a stop label in the test, where it cleans up
+#define FAIL(fmt, ...) \
+    do { fprintf(stderr, "%s: " fmt "\n", __func__, ##__VA_ARGS__); ret = 1; goto stop; } while (0)
+
+#define CHECK(cond, fmt, ...) \
+    do { if (!(cond)) FAIL(fmt, ##__VA_ARGS__); } while (0)
+
+#endif
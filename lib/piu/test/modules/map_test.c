@@ -0,0 +1,60 @@
+#include "map_test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "check.h"
+#include "internal/PIUMap.h"
+
+#define DEFAULT_NUM_KEYS 10000
+
+// Keys shaped like peer addresses: a few hosts, many ports each
+static uint64_t key_of(int i) {
+    return (uint64_t)(0x0100007f + (i % 8)) << 16 | (40000 + i / 8);
+}
+
+// Inserts the keys, removes a random half of them and checks every lookup,
+// against an array of what should be in the map.
+int piu_map_test(int num_keys) {
+    if (num_keys == 0)
+        num_keys = DEFAULT_NUM_KEYS;
+
+    char* present = calloc(num_keys, 1);
+    int* values = malloc(num_keys * sizeof(int));
+
+    PIUMap map;
+    piu_map_init(&map);
+
+    int ret = 0;
+    for (int i = 0; i < num_keys; i++) {
+        values[i] = i;
+        CHECK(piu_map_put(&map, key_of(i), &values[i]), "put %d failed", i);
+        present[i] = 1;
+    }
+
+    srand(time(0));
+    for (int n = 0; n < num_keys / 2; n++) {
+        int i = rand() % num_keys;
+        int* v = piu_map_remove(&map, key_of(i));
+        CHECK(present[i] == (v != NULL) && (v == NULL || *v == i), "remove %d returned %d", i, v ? *v : -1);
+        present[i] = 0;
+    }
+
+    int count = 0;
+    for (int i = 0; i < num_keys; i++) {
+        int* v = piu_map_get(&map, key_of(i));
+        CHECK(present[i] == (v != NULL) && (v == NULL || *v == i), "get %d returned %d, expected %d", i,
+              v ? *v : -1, present[i] ? i : -1);
+        count += present[i];
+    }
+    CHECK(map.count == (uint32_t)count, "map holds %u keys, expected %d", map.count, count);
+
+    printf("Map: %d keys found after removals, %u slots\n", count, map.mask + 1);
+
+stop:
+    piu_map_free(&map);
+    free(values);
+    free(present);
+    return ret;
+}
@@ -0,0 +1,6 @@
+#ifndef _PIU_TEST_MODULE_MAP_TEST_H
+#define _PIU_TEST_MODULE_MAP_TEST_H
+
+int piu_map_test(int num_keys);
+
+#endif
@@ -0,0 +1,36 @@
+#include "packet_test.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "check.h"
+#include "internal/PIUPacket.h"
+
+#define PAYLOAD_SIZE 100
+
+// Parses a datagram whole, cut at every length, and with a length field
+// larger than what follows it.
+int piu_packet_test(void) {
+    char data[PKT_HEADER_BYTES + PAYLOAD_SIZE], payload[PAYLOAD_SIZE];
+    memset(payload, 0x5a, sizeof payload);
+
+    PIUPacket pkt, parsed;
+    piu_packet_init_in(&pkt, data, 7, PIU_PKT_DATA, 42, payload, sizeof payload);
+
+    int ret = 0;
+    CHECK(piu_packet_parse(&parsed, data, sizeof data), "whole datagram refused");
+    CHECK(parsed.id == 7 && parsed.conn == 42 && parsed.payload_len == PAYLOAD_SIZE &&
+          memcmp(parsed.payload, payload, PAYLOAD_SIZE) == 0, "parsed packet differs");
+
+    for (uint32_t size = 0; size < sizeof data; size++)
+        CHECK(!piu_packet_parse(&parsed, data, size), "datagram cut at %u bytes accepted", size);
+
+    // A header-only datagram claiming the largest payload
+    piu_packet_init_in(&pkt, data, 7, PIU_PKT_DATA, 42, NULL, 0xffffffff);
+    CHECK(!piu_packet_parse(&parsed, data, PKT_HEADER_BYTES), "payload length past the datagram accepted");
+
+    printf("Packet: truncated datagrams refused\n");
+
+stop:
+    return ret;
+}
@@ -0,0 +1,6 @@
+#ifndef _PIU_TEST_MODULE_PACKET_TEST_H
+#define _PIU_TEST_MODULE_PACKET_TEST_H
+
+int piu_packet_test(void);
+
+#endif
@@ -0,0 +1,282 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/shm.h>
+#include <X11/Xutil.h>
+
+static void die(const char *errstr, ...) {
+    va_list ap;
+
+    va_start(ap, errstr);
+    vfprintf(stderr, errstr, ap);
+    va_end(ap);
+    exit(1);
+}
+
+void damage_clear(damage_t* d) {
+    memset(d, 0, sizeof *d);
+}
+
+void damage_fill(damage_t* d, int width, int height) {
+    d->nrects = 1;
+    d->rects[0] = (XRectangle){0, 0, width, height};
+    memset(d->bands, 0xff, sizeof d->bands);
+}
+
+// Rows past the bands fall in the last one, see damage_next_rows()
+static int band_of(int y) {
+    int b = y / DAMAGE_BAND_ROWS;
+    return b < DAMAGE_MAX_BANDS ? b : DAMAGE_MAX_BANDS - 1;
+}
+
+static void damage_add_rows(damage_t* d, int y, int height) {
+    int first = band_of(y);
+    int last = band_of(y + height - 1);
+
+    for (int b = first; b <= last; b++)
+        d->bands[b / 64] |= 1ull << (b % 64);
+}
+
+void damage_add(damage_t* d, const XRectangle* r) {
+    if (r->width == 0 || r->height == 0)
+        return;
+
+    damage_add_rows(d, r->y, r->height);
+
+    if (d->nrects < DAMAGE_MAX_RECTS) {
+        d->rects[d->nrects++] = *r;
+        return;
+    }
+
+    // Out of room, grow the last rectangle to cover the new one
+    XRectangle* b = &d->rects[DAMAGE_MAX_RECTS - 1];
+    int x0 = r->x < b->x ? r->x : b->x;
+    int y0 = r->y < b->y ? r->y : b->y;
+    int x1 = r->x + r->width > b->x + b->width ? r->x + r->width : b->x + b->width;
+    int y1 = r->y + r->height > b->y + b->height ? r->y + r->height : b->y + b->height;
+
+    *b = (XRectangle){x0, y0, x1 - x0, y1 - y0};
+}
+
+void damage_merge(damage_t* dst, const damage_t* src) {
+    for (int i = 0; i < src->nrects; i++)
+        damage_add(dst, &src->rects[i]);
+
+    // Bands may hold more than the rects (see damage_fill)
+    for (int i = 0; i < DAMAGE_MAX_BANDS / 64; i++)
+        dst->bands[i] |= src->bands[i];
+}
+
+bool damage_empty(const damage_t* d) {
+    for (int i = 0; i < DAMAGE_MAX_BANDS / 64; i++) {
+        if (d->bands[i])
+            return false;
+    }
+    return true;
+}
+
+static bool band_set(const damage_t* d, int b) {
+    return b < DAMAGE_MAX_BANDS && (d->bands[b / 64] >> (b % 64)) & 1;
+}
+
+bool damage_next_rows(const damage_t* d, int height, int* y, int* end) {
+    if (*y >= height)
+        return false;
+
+    int b = band_of(*y);
+    int last = band_of(height - 1) + 1;
+
+    while (b < last && !band_set(d, b))
+        b++;
+    if (b >= last)
+        return false;
+
+    int e = b;
+    while (e < last && band_set(d, e))
+        e++;
+
+    *y = b * DAMAGE_BAND_ROWS;
+    *end = e * DAMAGE_BAND_ROWS < height && e < DAMAGE_MAX_BANDS ? e * DAMAGE_BAND_ROWS : height;
+    return true;
+}
+
+static void capture_init(capture_t* cap, Display* dpy, Screen* screen, int width, int height) {
+    cap->image = XShmCreateImage(dpy, XDefaultVisualOfScreen(screen), XDefaultDepthOfScreen(screen), ZPixmap,
+            0, &cap->shminfo, width, height);
+
+    if (!cap->image) {
+        die("failed to create image");
+    }
+
+    cap->shminfo.shmid = shmget(IPC_PRIVATE, cap->image->bytes_per_line * cap->image->height, IPC_CREAT | 0600);
+    if (cap->shminfo.shmid == -1) {
+        die("shmget: %s\n", strerror(errno));
+    }
+
+    cap->shminfo.shmaddr = cap->image->data = shmat(cap->shminfo.shmid, 0, 0);
+    cap->shminfo.readOnly = False;
+    shmctl(cap->shminfo.shmid, IPC_RMID, 0) ;
+
+    if (!XShmAttach(dpy, &cap->shminfo)) {
+        die("failed to attach!\n");
+    }
+
+    cap->frame = NULL;
+    cap->npending = 0;
+    cap->pts = 0;
+    cap->seq = 0;
+    damage_clear(&cap->delta);
+    damage_fill(&cap->stale, width, height);
+    damage_clear(&cap->grabbed);
+}
+
+void capture_source_init(capture_source_t* src, Display* dpy, Screen* screen, Window window,
+                         const XRectangle* area, capture_t* caps, int count, bool use_damage) {
+    src->dpy = dpy;
+    src->conn = XGetXCBConnection(dpy);
+    src->drawable = window != None ? window : RootWindowOfScreen(screen);
+
+    Window root;
+    int x, y;
+    unsigned width, height, border, depth;
+    if (!XGetGeometry(dpy, src->drawable, &root, &x, &y, &width, &height, &border, &depth)) {
+        die("capture: invalid window: 0x%lx\n", window);
+    }
+    if (depth != XDefaultDepthOfScreen(screen)) {
+        die("capture: window depth %u does not match the screen\n", depth);
+    }
+
+    src->x = 0;
+    src->y = 0;
+    src->width = width;
+    src->height = height;
+    if (area != NULL) {
+        if (area->x < 0 || area->y < 0 || area->width == 0 || area->height == 0 ||
+            area->x + area->width > (int)width || area->y + area->height > (int)height) {
+            die("capture: area %ux%u+%d+%d outside of %ux%u\n",
+                area->width, area->height, area->x, area->y, width, height);
+        }
+        src->x = area->x;
+        src->y = area->y;
+        src->width = area->width;
+        src->height = area->height;
+    }
+
+    src->caps = caps;
+    src->count = count;
+    src->use_damage = use_damage;
+
+    for (int i = 0; i < count; i++)
+        capture_init(&caps[i], dpy, screen, src->width, src->height);
+
+    if (!use_damage)
+        return;
+
+    int error_base;
+    if (!XFixesQueryExtension(dpy, &error_base, &error_base) ||
+        !XDamageQueryExtension(dpy, &src->damage_event, &error_base)) {
+        die("scp: the X server does not support the XDAMAGE extension\n");
+    }
+
+    // NonEmpty: one event when the damage region stops being empty; the
+    // region itself is fetched and emptied by capture_poll().
+    src->damage = XDamageCreate(dpy, src->drawable, XDamageReportNonEmpty);
+    src->region = XFixesCreateRegion(dpy, NULL, 0);
+}
+
+void capture_source_free(capture_source_t* src) {
+    if (src->use_damage) {
+        XFixesDestroyRegion(src->dpy, src->region);
+        XDamageDestroy(src->dpy, src->damage);
+    }
+
+    for (int i = 0; i < src->count; i++) {
+        capture_t* cap = &src->caps[i];
+
+        capture_wait(src, cap);
+        XShmDetach(src->dpy, &cap->shminfo);
+        XDestroyImage(cap->image);
+        shmdt(cap->shminfo.shmaddr);
+        av_frame_free(&cap->frame);
+    }
+}
+
+bool capture_poll(capture_source_t* src, damage_t* delta) {
+    damage_clear(delta);
+
+    if (!src->use_damage) {
+        damage_fill(delta, src->width, src->height);
+    } else {
+        bool notified = false;
+        while (XPending(src->dpy)) {
+            XEvent ev;
+            XNextEvent(src->dpy, &ev);
+            if (ev.type == src->damage_event + XDamageNotify)
+                notified = true;
+        }
+
+        if (!notified)
+            return false;
+
+        XDamageSubtract(src->dpy, src->damage, None, src->region);
+
+        int n;
+        XRectangle* rects = XFixesFetchRegion(src->dpy, src->region, &n);
+        // Relative to the drawable; clipped and moved to the captured area
+        for (int i = 0; i < n; i++) {
+            int x0 = rects[i].x > src->x ? rects[i].x : src->x;
+            int y0 = rects[i].y > src->y ? rects[i].y : src->y;
+            int x1 = rects[i].x + rects[i].width < src->x + src->width ? rects[i].x + rects[i].width : src->x + src->width;
+            int y1 = rects[i].y + rects[i].height < src->y + src->height ? rects[i].y + rects[i].height : src->y + src->height;
+            if (x0 >= x1 || y0 >= y1)
+                continue;
+
+            damage_add(delta, &(XRectangle){x0 - src->x, y0 - src->y, x1 - x0, y1 - y0});
+        }
+        if (rects)
+            XFree(rects);
+
+        if (damage_empty(delta))
+            return false;
+    }
+
+    for (int i = 0; i < src->count; i++)
+        damage_merge(&src->caps[i].stale, delta);
+
+    return true;
+}
+
+void capture_request(capture_source_t* src, capture_t* cap) {
+    capture_wait(src, cap);
+
+    int y = 0, end;
+    int bpl = cap->image->bytes_per_line;
+
+    // Rows are requested in full-width runs, each landing at its own offset
+    // in the segment with the image stride.
+    while (damage_next_rows(&cap->stale, cap->image->height, &y, &end)) {
+        cap->pending[cap->npending++] = xcb_shm_get_image(src->conn, src->drawable, src->x, src->y + y,
+                cap->image->width, end - y, ~0u, XCB_IMAGE_FORMAT_Z_PIXMAP, cap->shminfo.shmseg, (uint32_t)y * bpl);
+        y = end;
+    }
+    xcb_flush(src->conn);
+
+    damage_merge(&cap->grabbed, &cap->stale);
+    damage_clear(&cap->stale);
+}
+
+void capture_wait(const capture_source_t* src, capture_t* cap) {
+    for (int i = 0; i < cap->npending; i++) {
+        xcb_generic_error_t* err = NULL;
+        xcb_shm_get_image_reply_t* reply = xcb_shm_get_image_reply(src->conn, cap->pending[i], &err);
+        if (!reply) {
+            die("capture: xcb_shm_get_image failed: error %d\n", err ? err->error_code : 0);
+        }
+        free(reply);
+    }
+    cap->npending = 0;
+}
@@ -0,0 +1,103 @@
+#ifndef _SCP_CAPTURE_H
+#define _SCP_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+#include <libavutil/frame.h>
+#include <xcb/shm.h>
+
+#define DAMAGE_MAX_RECTS 64
+#define DAMAGE_BAND_ROWS 16 // Even, so bands never split a chroma row
+#define DAMAGE_MAX_BANDS 512
+
+// Changed screen area: the rectangles as reported by XDamage (collapsed to
+// their bounding box past DAMAGE_MAX_RECTS), and the rows they touch in
+// bands of DAMAGE_BAND_ROWS, which is what buffers are refreshed by. On
+// screens taller than the bands, the last one holds every row left.
+typedef struct {
+    XRectangle rects[DAMAGE_MAX_RECTS];
+    int nrects;
+
+    uint64_t bands[DAMAGE_MAX_BANDS / 64];
+} damage_t;
+
+void damage_clear(damage_t* d);
+void damage_fill(damage_t* d, int width, int height);
+void damage_add(damage_t* d, const XRectangle* r);
+void damage_merge(damage_t* dst, const damage_t* src);
+bool damage_empty(const damage_t* d);
+
+// Finds the first run of damaged rows starting at row *y, limited to height.
+// Returns false when there is none left; otherwise the run is [*y, *end).
+bool damage_next_rows(const damage_t* d, int height, int* y, int* end);
+
+// A capture buffer: an XShm image and, in passthrough mode, the frame
+// wrapping its memory.
+typedef struct {
+    XImage* image;
+    XShmSegmentInfo shminfo;
+    AVFrame* frame;
+
+    // Requests in flight, one per run of rows; see capture_wait()
+    xcb_shm_get_image_cookie_t pending[DAMAGE_MAX_BANDS];
+    int npending;
+
+    int64_t pts;
+    uint64_t seq; // Publication order, gaps mean dropped captures
+
+    // Damage since the previously published capture
+    damage_t delta;
+
+    // Rows of the image older than the screen; owned by the capture thread
+    damage_t stale;
+
+    // Rows written since the consumer last cleared this, e.g. to rehash them
+    damage_t grabbed;
+} capture_t;
+
+typedef struct {
+    Display* dpy;
+    xcb_connection_t* conn;
+
+    // Captured area, in drawable coordinates
+    Drawable drawable;
+    int x, y;
+    int width, height;
+
+    capture_t* caps;
+    int count;
+
+    // XDamage, if enabled
+    bool use_damage;
+    Damage damage;
+    XserverRegion region;
+    int damage_event;
+} capture_source_t;
+
+// Creates count capture buffers of an area of a window: the root window if
+// window is None, and the whole window if area is NULL. With use_damage, only
+// changed rows are grabbed, and the XDamage extension is required.
+void capture_source_init(capture_source_t* src, Display* dpy, Screen* screen, Window window,
+                         const XRectangle* area, capture_t* caps, int count, bool use_damage);
+void capture_source_free(capture_source_t* src);
+
+// Collects the damage since the last call into delta, and marks it stale in
+// every buffer. Returns false if the screen did not change. Without XDamage
+// the whole screen is always damaged.
+bool capture_poll(capture_source_t* src, damage_t* delta);
+
+// Requests the stale rows of cap from the X server and returns without
+// waiting, so the round-trip overlaps with the rest of the pipeline. Pending
+// requests of a buffer that was never waited for (a dropped capture) are
+// completed first.
+void capture_request(capture_source_t* src, capture_t* cap);
+
+// Waits until the requested rows have landed in the image. May be called from
+// another thread than capture_request(), once the buffer is handed over.
+void capture_wait(const capture_source_t* src, capture_t* cap);
+
+#endif
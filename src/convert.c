@@ -0,0 +1,529 @@
+#include "convert.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86
+#endif
+
+typedef void (*swizzle_fn)(uint8_t* dst, const uint8_t* src, int n, const convert_t* cv);
+
+static swizzle_fn swizzle = NULL;
+static const char* swizzle_name = "none";
+
+// Helper threads; band 0 of every frame is converted by the caller.
+static struct {
+    int count;
+    pthread_t* threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    unsigned generation;
+    int pending;
+
+    const convert_t* cv;
+    AVFrame* frame;
+    const XImage* image;
+    int begin, end;
+} pool;
+
+static void swizzle_c(uint8_t* dst, const uint8_t* src, int n, const convert_t* cv) {
+    const uint8_t* m = cv->map;
+
+    for (int i = 0; i < n; i++, dst += 4, src += 4) {
+        uint8_t px[5] = {src[0], src[1], src[2], src[3], CONVERT_FILL};
+
+        dst[0] = px[m[0] < 4 ? m[0] : 4];
+        dst[1] = px[m[1] < 4 ? m[1] : 4];
+        dst[2] = px[m[2] < 4 ? m[2] : 4];
+        dst[3] = px[m[3] < 4 ? m[3] : 4];
+    }
+}
+
+#ifdef CONVERT_X86
+// Byte-wise move using shifts and masks, since SSE2 has no byte shuffle.
+__attribute__((target("sse2")))
+static void swizzle_sse2(uint8_t* dst, const uint8_t* src, int n, const convert_t* cv) {
+    const __m128i byte = _mm_set1_epi32(0xff);
+    const __m128i fill = _mm_set1_epi32(cv->fill);
+    __m128i rshift[4], lshift[4];
+    int k = 0;
+
+    for (int i = 0; i < 4; i++) {
+        if (cv->map[i] == CONVERT_FILL)
+            continue;
+        rshift[k] = _mm_cvtsi32_si128(8 * cv->map[i]);
+        lshift[k] = _mm_cvtsi32_si128(8 * i);
+        k++;
+    }
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+        __m128i r = fill;
+
+        for (int j = 0; j < k; j++) {
+            __m128i c = _mm_and_si128(_mm_srl_epi32(p, rshift[j]), byte);
+            r = _mm_or_si128(r, _mm_sll_epi32(c, lshift[j]));
+        }
+
+        _mm_storeu_si128((__m128i*)(dst + 4 * i), r);
+    }
+
+    swizzle_c(dst + 4 * i, src + 4 * i, n - i, cv);
+}
+
+__attribute__((target("ssse3")))
+static void swizzle_ssse3(uint8_t* dst, const uint8_t* src, int n, const convert_t* cv) {
+    const __m128i ctl = _mm_loadu_si128((const __m128i*)cv->shuffle);
+    const __m128i fill = _mm_set1_epi32(cv->fill);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 4 * i + 16));
+
+        a = _mm_or_si128(_mm_shuffle_epi8(a, ctl), fill);
+        b = _mm_or_si128(_mm_shuffle_epi8(b, ctl), fill);
+
+        _mm_storeu_si128((__m128i*)(dst + 4 * i), a);
+        _mm_storeu_si128((__m128i*)(dst + 4 * i + 16), b);
+    }
+
+    swizzle_c(dst + 4 * i, src + 4 * i, n - i, cv);
+}
+
+__attribute__((target("avx2")))
+static void swizzle_avx2(uint8_t* dst, const uint8_t* src, int n, const convert_t* cv) {
+    const __m256i ctl = _mm256_loadu_si256((const __m256i*)cv->shuffle);
+    const __m256i fill = _mm256_set1_epi32(cv->fill);
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + 4 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 4 * i + 32));
+
+        a = _mm256_or_si256(_mm256_shuffle_epi8(a, ctl), fill);
+        b = _mm256_or_si256(_mm256_shuffle_epi8(b, ctl), fill);
+
+        _mm256_storeu_si256((__m256i*)(dst + 4 * i), a);
+        _mm256_storeu_si256((__m256i*)(dst + 4 * i + 32), b);
+    }
+
+    swizzle_c(dst + 4 * i, src + 4 * i, n - i, cv);
+}
+#endif
+
+// Box filter: each destination byte averages a scale x scale block of the
+// same channel. Rows are summed first, which vectorizes for any factor.
+__attribute__((target_clones("avx2", "default")))
+static void downscale_row(const uint8_t* restrict src, int stride, uint8_t* restrict dst,
+                          int width, int scale) {
+    uint16_t acc[4 * width * scale];
+    memset(acc, 0, sizeof acc);
+
+    for (int k = 0; k < scale; k++) {
+        const uint8_t* row = src + (ptrdiff_t)k * stride;
+        for (int i = 0; i < 4 * width * scale; i++)
+            acc[i] += row[i];
+    }
+
+    // Fixed-point reciprocal of the block area, rounded
+    uint32_t n = scale * scale;
+    uint32_t recip = (65536 + n / 2) / n;
+
+    for (int x = 0; x < width; x++) {
+        for (int c = 0; c < 4; c++) {
+            uint32_t sum = 0;
+            for (int k = 0; k < scale; k++)
+                sum += acc[4 * (x * scale + k) + c];
+
+            uint32_t v = (sum * recip + 32768) >> 16;
+            dst[4 * x + c] = v > 255 ? 255 : v;
+        }
+    }
+}
+
+static void downscale_rows(const convert_t* cv, const XImage* image, int begin, int end) {
+    const XImage* dst = &cv->scaled;
+
+    for (int y = begin; y < end; y++) {
+        const uint8_t* src = (const uint8_t*)image->data + (ptrdiff_t)y * cv->scale * image->bytes_per_line;
+        downscale_row(src, image->bytes_per_line, (uint8_t*)dst->data + (ptrdiff_t)y * dst->bytes_per_line,
+                      dst->width, cv->scale);
+    }
+}
+
+static void convert_band(int band, int bands, const convert_t* cv, AVFrame* frame, const XImage* image,
+                         int begin, int end);
+
+static void* pool_worker(void* arg) {
+    int band = (intptr_t)arg;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        convert_band(band, pool.count + 1, pool.cv, pool.frame, pool.image, pool.begin, pool.end);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0)
+            pthread_cond_signal(&pool.done);
+    }
+    return NULL;
+}
+
+void convert_init(int threads) {
+    swizzle = swizzle_c;
+    swizzle_name = "c";
+
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        swizzle = swizzle_avx2;
+        swizzle_name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        swizzle = swizzle_ssse3;
+        swizzle_name = "ssse3";
+    } else if (__builtin_cpu_supports("sse2")) {
+        swizzle = swizzle_sse2;
+        swizzle_name = "sse2";
+    }
+#endif
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.start, NULL);
+    pthread_cond_init(&pool.done, NULL);
+
+    pool.count = 0;
+    pool.threads = threads > 1 ? malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&pool.threads[pool.count], NULL, pool_worker, (void*)(intptr_t)i) != 0) {
+            fprintf(stderr, "convert: failed to start helper thread\n");
+            break;
+        }
+        pool.count++;
+    }
+}
+
+const char* convert_impl_name(void) {
+    return swizzle_name;
+}
+
+// Returns the byte offset of an 8-bit channel inside a 32-bit pixel, or -1 if
+// the mask is not byte aligned.
+static int mask_to_byte(unsigned long mask, int byte_order) {
+    if (mask == 0)
+        return -1;
+
+    int shift = __builtin_ctzl(mask);
+    if (shift % 8 != 0 || (mask >> shift) != 0xff || shift > 24)
+        return -1;
+
+    return byte_order == LSBFirst ? shift / 8 : 3 - shift / 8;
+}
+
+// Source byte offsets of R, G and B, or false if not 8-bit channels.
+static bool image_layout(const XImage* image, int* r, int* g, int* b) {
+    if (image->bits_per_pixel != 32) {
+        fprintf(stderr, "convert: unsupported bits per pixel: %d\n", image->bits_per_pixel);
+        return false;
+    }
+
+    *r = mask_to_byte(image->red_mask, image->byte_order);
+    *g = mask_to_byte(image->green_mask, image->byte_order);
+    *b = mask_to_byte(image->blue_mask, image->byte_order);
+    if (*r < 0 || *g < 0 || *b < 0) {
+        fprintf(stderr, "convert: unsupported visual masks: %lx %lx %lx\n",
+                image->red_mask, image->green_mask, image->blue_mask);
+        return false;
+    }
+
+    return true;
+}
+
+// Destination byte offsets of R, G and B for packed formats.
+static bool packed_layout(enum AVPixelFormat fmt, int* r, int* g, int* b) {
+    switch (fmt) {
+    case AV_PIX_FMT_RGB0:
+    case AV_PIX_FMT_RGBA:
+        *r = 0, *g = 1, *b = 2;
+        return true;
+    case AV_PIX_FMT_BGR0:
+    case AV_PIX_FMT_BGRA:
+        *r = 2, *g = 1, *b = 0;
+        return true;
+    case AV_PIX_FMT_0RGB:
+        *r = 1, *g = 2, *b = 3;
+        return true;
+    case AV_PIX_FMT_0BGR:
+        *r = 3, *g = 2, *b = 1;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_yuv(enum AVPixelFormat fmt) {
+    return fmt == AV_PIX_FMT_NV12 || fmt == AV_PIX_FMT_YUV420P;
+}
+
+static bool accepts(const enum AVPixelFormat* accepted, enum AVPixelFormat fmt) {
+    for (const enum AVPixelFormat* p = accepted; *p != AV_PIX_FMT_NONE; p++) {
+        if (*p == fmt)
+            return true;
+    }
+    return false;
+}
+
+// Packed formats with padding instead of alpha, so the X padding byte can be
+// passed through untouched.
+static const enum AVPixelFormat packed_formats[] = {
+    AV_PIX_FMT_BGR0, AV_PIX_FMT_RGB0, AV_PIX_FMT_0RGB, AV_PIX_FMT_0BGR,
+};
+
+enum AVPixelFormat convert_negotiate(const XImage* image, const enum AVPixelFormat* accepted) {
+    if (accepted == NULL)
+        return AV_PIX_FMT_YUV420P;
+
+    convert_t cv;
+    for (int i = 0; i < sizeof packed_formats / sizeof *packed_formats; i++) {
+        enum AVPixelFormat fmt = packed_formats[i];
+        if (accepts(accepted, fmt) && convert_setup(&cv, image, fmt) &&
+            convert_is_passthrough(&cv))
+            return fmt;
+    }
+
+    if (accepts(accepted, AV_PIX_FMT_NV12))
+        return AV_PIX_FMT_NV12;
+    if (accepts(accepted, AV_PIX_FMT_YUV420P))
+        return AV_PIX_FMT_YUV420P;
+
+    for (int i = 0; i < sizeof packed_formats / sizeof *packed_formats; i++) {
+        if (accepts(accepted, packed_formats[i]))
+            return packed_formats[i];
+    }
+
+    return AV_PIX_FMT_NONE;
+}
+
+bool convert_setup(convert_t* cv, const XImage* image, enum AVPixelFormat dst) {
+    if (!image_layout(image, &cv->r, &cv->g, &cv->b))
+        return false;
+
+    cv->dst = dst;
+    cv->scale = 1;
+    if (is_yuv(dst))
+        return true;
+
+    int dr, dg, db;
+    if (!packed_layout(dst, &dr, &dg, &db)) {
+        fprintf(stderr, "convert: unsupported destination format: %d\n", dst);
+        return false;
+    }
+
+    memset(cv->map, CONVERT_FILL, sizeof cv->map);
+    cv->map[dr] = cv->r;
+    cv->map[dg] = cv->g;
+    cv->map[db] = cv->b;
+
+    cv->fill = 0;
+    for (int i = 0; i < 4; i++) {
+        if (cv->map[i] == CONVERT_FILL)
+            cv->fill |= 0xffu << (8 * i);
+    }
+
+    // pshufb control: 0x80 zeroes the byte, which is then or-ed with fill
+    for (int i = 0; i < (int)sizeof cv->shuffle; i++) {
+        uint8_t m = cv->map[i % 4];
+        cv->shuffle[i] = m == CONVERT_FILL ? 0x80 : (i % 16) / 4 * 4 + m;
+    }
+
+    return true;
+}
+
+bool convert_set_scale(convert_t* cv, const XImage* image, int scale) {
+    if (scale < 1 || scale > CONVERT_MAX_SCALE || image->width < scale || image->height < scale)
+        return false;
+
+    convert_free(cv);
+    cv->scale = scale;
+    if (scale == 1)
+        return true;
+
+    cv->scaled = *image;
+    cv->scaled.width = image->width / scale;
+    cv->scaled.height = image->height / scale;
+    cv->scaled.bytes_per_line = 4 * cv->scaled.width;
+    cv->scaled.data = malloc((size_t)cv->scaled.bytes_per_line * cv->scaled.height);
+    return cv->scaled.data != NULL;
+}
+
+void convert_free(convert_t* cv) {
+    if (cv->scale > 1)
+        free(cv->scaled.data);
+    cv->scale = 1;
+}
+
+bool convert_is_passthrough(const convert_t* cv) {
+    if (cv->scale > 1 || is_yuv(cv->dst) || cv->dst == AV_PIX_FMT_RGBA || cv->dst == AV_PIX_FMT_BGRA)
+        return false;
+
+    for (int i = 0; i < 4; i++) {
+        if (cv->map[i] != CONVERT_FILL && cv->map[i] != i)
+            return false;
+    }
+    return true;
+}
+
+// BT.709 limited range, 8-bit fixed point. Chroma takes the sum of a 2x2
+// block, hence the two extra bits of shift.
+#define RGB_TO_Y(r, g, b) (((47 * (r) + 157 * (g) + 16 * (b) + 128) >> 8) + 16)
+#define RGB4_TO_U(r, g, b) (((-26 * (r) - 86 * (g) + 112 * (b) + 512) >> 10) + 128)
+#define RGB4_TO_V(r, g, b) (((112 * (r) - 102 * (g) - 10 * (b) + 512) >> 10) + 128)
+
+// Converts two source rows into two luma rows and one chroma row. Source
+// channels are extracted with shifts so the loops vectorize for any layout.
+__attribute__((target_clones("avx2", "default")))
+static void yuv_rows(const uint32_t* restrict s0, const uint32_t* restrict s1,
+                     uint8_t* restrict y0, uint8_t* restrict y1,
+                     uint8_t* restrict u, uint8_t* restrict v, int uv_step,
+                     int width, int rs, int gs, int bs) {
+    for (int x = 0; x < width; x++) {
+        uint32_t p = s0[x], q = s1[x];
+
+        y0[x] = RGB_TO_Y((p >> rs) & 0xff, (p >> gs) & 0xff, (p >> bs) & 0xff);
+        y1[x] = RGB_TO_Y((q >> rs) & 0xff, (q >> gs) & 0xff, (q >> bs) & 0xff);
+    }
+
+    for (int x = 0; x < width / 2; x++) {
+        uint32_t a = s0[2 * x], b = s0[2 * x + 1];
+        uint32_t c = s1[2 * x], d = s1[2 * x + 1];
+
+        int r = ((a >> rs) & 0xff) + ((b >> rs) & 0xff) + ((c >> rs) & 0xff) + ((d >> rs) & 0xff);
+        int g = ((a >> gs) & 0xff) + ((b >> gs) & 0xff) + ((c >> gs) & 0xff) + ((d >> gs) & 0xff);
+        int bl = ((a >> bs) & 0xff) + ((b >> bs) & 0xff) + ((c >> bs) & 0xff) + ((d >> bs) & 0xff);
+
+        u[x * uv_step] = RGB4_TO_U(r, g, bl);
+        v[x * uv_step] = RGB4_TO_V(r, g, bl);
+    }
+
+    if (width % 2) {
+        uint32_t a = s0[width - 1], c = s1[width - 1];
+
+        int r = 2 * (((a >> rs) & 0xff) + ((c >> rs) & 0xff));
+        int g = 2 * (((a >> gs) & 0xff) + ((c >> gs) & 0xff));
+        int bl = 2 * (((a >> bs) & 0xff) + ((c >> bs) & 0xff));
+
+        u[(width / 2) * uv_step] = RGB4_TO_U(r, g, bl);
+        v[(width / 2) * uv_step] = RGB4_TO_V(r, g, bl);
+    }
+}
+
+static void convert_rows_yuv(const convert_t* cv, AVFrame* frame, const XImage* image,
+                             int width, int height, int begin, int end) {
+    // Byte offsets to shifts of a little-endian 32-bit load
+    int rs = 8 * cv->r, gs = 8 * cv->g, bs = 8 * cv->b;
+
+    for (int y = begin; y < end; y += 2) {
+        const uint8_t* src = (const uint8_t*)image->data;
+        const uint32_t* s0 = (const uint32_t*)(src + (ptrdiff_t)y * image->bytes_per_line);
+        const uint32_t* s1 = y + 1 < height ? (const uint32_t*)((const uint8_t*)s0 + image->bytes_per_line) : s0;
+
+        uint8_t* y0 = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+        uint8_t* y1 = y + 1 < height ? y0 + frame->linesize[0] : y0;
+
+        if (cv->dst == AV_PIX_FMT_NV12) {
+            uint8_t* uv = frame->data[1] + (ptrdiff_t)(y / 2) * frame->linesize[1];
+            yuv_rows(s0, s1, y0, y1, uv, uv + 1, 2, width, rs, gs, bs);
+        } else {
+            uint8_t* u = frame->data[1] + (ptrdiff_t)(y / 2) * frame->linesize[1];
+            uint8_t* v = frame->data[2] + (ptrdiff_t)(y / 2) * frame->linesize[2];
+            yuv_rows(s0, s1, y0, y1, u, v, 1, width, rs, gs, bs);
+        }
+    }
+}
+
+static void convert_rows_packed(const convert_t* cv, AVFrame* frame, const XImage* image,
+                                int width, int begin, int end) {
+    for (int y = begin; y < end; y++) {
+        uint8_t* dst = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+        const uint8_t* src = (const uint8_t*)image->data + (ptrdiff_t)y * image->bytes_per_line;
+
+        swizzle(dst, src, width, cv);
+    }
+}
+
+static void convert_band(int band, int bands, const convert_t* cv, AVFrame* frame, const XImage* image,
+                         int begin, int end) {
+    // Bands are cut at even rows, so chroma rows are never shared
+    int pairs = (end - begin + 1) / 2;
+    int b = begin + 2 * (pairs * band / bands);
+    int e = begin + 2 * (pairs * (band + 1) / bands);
+    if (e > end)
+        e = end;
+
+    if (cv->scale > 1) {
+        downscale_rows(cv, image, b, e);
+        image = &cv->scaled;
+    }
+
+    int width = frame->width < image->width ? frame->width : image->width;
+    int height = frame->height < image->height ? frame->height : image->height;
+
+    if (is_yuv(cv->dst))
+        convert_rows_yuv(cv, frame, image, width, height, b, e);
+    else
+        convert_rows_packed(cv, frame, image, width, b, e);
+}
+
+void convert_rows(const convert_t* cv, AVFrame* frame, const XImage* image, int begin, int end) {
+    int height = image->height / cv->scale;
+    if (frame->height < height)
+        height = frame->height;
+
+    // Pairs of frame rows are converted together, and a downscaled row must
+    // be rebuilt before it is read
+    begin = begin / cv->scale & ~1;
+    end = ((end + cv->scale - 1) / cv->scale + 1) & ~1;
+    if (end > height)
+        end = height;
+    if (begin >= end)
+        return;
+
+    if (pool.count == 0) {
+        convert_band(0, 1, cv, frame, image, begin, end);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.cv = cv;
+    pool.frame = frame;
+    pool.image = image;
+    pool.begin = begin;
+    pool.end = end;
+    pool.pending = pool.count;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    convert_band(0, pool.count + 1, cv, frame, image, begin, end);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void convert_frame(const convert_t* cv, AVFrame* frame, const XImage* image) {
+    convert_rows(cv, frame, image, 0, image->height);
+}
@@ -0,0 +1,67 @@
+#ifndef _SCP_CONVERT_H
+#define _SCP_CONVERT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <libavutil/frame.h>
+
+// Fill byte, used for destination channels with no source (padding/alpha).
+#define CONVERT_FILL 0xff
+
+#define CONVERT_MAX_SCALE 8
+
+// Describes how a 32-bit XImage pixel is turned into a frame of format dst.
+//
+// For packed RGB formats, byte i of the destination pixel is byte map[i] of
+// the source pixel, or 0xff if map[i] == CONVERT_FILL. For YUV formats, the
+// R, G and B channels are read from the source pixel bytes r, g and b.
+typedef struct {
+    enum AVPixelFormat dst;
+    int r, g, b;
+
+    uint8_t map[4];
+
+    // Derived from map by convert_setup()
+    uint8_t shuffle[32]; // pshufb control for 8 pixels
+    uint32_t fill;       // Or-mask setting the filled bytes
+
+    // Downscale factor, and the downscaled image when above 1
+    int scale;
+    XImage scaled;
+} convert_t;
+
+// Picks the fastest swizzle kernel for this CPU and starts threads - 1
+// helper threads for banded conversion. Must be called once before
+// convert_frame().
+void convert_init(int threads);
+const char* convert_impl_name(void);
+
+// Chooses the input format to feed the encoder among the accepted ones
+// (terminated by AV_PIX_FMT_NONE, or NULL if unknown). In order: a packed
+// format matching the image layout (no conversion), NV12, YUV420P, and then
+// any other packed RGB format.
+enum AVPixelFormat convert_negotiate(const XImage* image, const enum AVPixelFormat* accepted);
+
+// Computes the conversion from the image visual (masks, byte order) to the
+// given frame format. Returns false if the layout is unsupported.
+bool convert_setup(convert_t* cv, const XImage* image, enum AVPixelFormat dst);
+
+// Shrinks the image by an integer factor (box filter) before converting, so
+// frames are image->width / scale by image->height / scale. Returns false if
+// the factor is out of range or the buffer cannot be allocated. May be called
+// again to change the factor.
+bool convert_set_scale(convert_t* cv, const XImage* image, int scale);
+void convert_free(convert_t* cv);
+
+// True if the image memory can be handed to the encoder as is. Never the case
+// when downscaling.
+bool convert_is_passthrough(const convert_t* cv);
+
+void convert_frame(const convert_t* cv, AVFrame* frame, const XImage* image);
+
+// Converts the frame rows covering image rows [begin, end) only; rows are
+// widened to even boundaries.
+void convert_rows(const convert_t* cv, AVFrame* frame, const XImage* image, int begin, int end);
+
+#endif
@@ -0,0 +1,125 @@
+#include "encoder.h"
+
+#include <string.h>
+#include <libavutil/opt.h>
+
+static const char* const nvenc_options[] = {
+    "preset", "p3",
+    "tune", "ull",
+    "zerolatency", "1",
+    "delay", "0",
+    "forced-idr", "1",
+    "qp", "18",
+    NULL,
+};
+
+static const char* const x264_options[] = {
+    "preset", "ultrafast",
+    "tune", "zerolatency",
+    "x264-params", "sliced-threads=1:sync-lookahead=0:rc-lookahead=0",
+    "forced-idr", "1",
+    "qp", "18",
+    NULL,
+};
+
+static const char* const x265_options[] = {
+    "preset", "ultrafast",
+    "tune", "zerolatency",
+    "x265-params", "frame-threads=1:rc-lookahead=0",
+    "forced-idr", "1",
+    "qp", "18",
+    NULL,
+};
+
+static const char* const vp8_options[] = {
+    "deadline", "realtime",
+    "cpu-used", "8",
+    "lag-in-frames", "0",
+    "error-resilient", "default",
+    "b", "8M",
+    NULL,
+};
+
+static const char* const nvenc_intra_refresh[] = {
+    "intra-refresh", "1",
+    NULL,
+};
+
+static const char* const x264_intra_refresh[] = {
+    "intra-refresh", "1",
+    NULL,
+};
+
+static const char* const x265_intra_refresh[] = {
+    "x265-params", "frame-threads=1:rc-lookahead=0:intra-refresh=1",
+    NULL,
+};
+
+// libx264 only applies regions through adaptive quantization, which the
+// ultrafast preset turns off. x265 keeps it on, and libvpx needs none.
+static const char* const x264_roi[] = {
+    "aq-mode", "variance",
+    NULL,
+};
+
+static const char* const no_options[] = {
+    NULL,
+};
+
+static const char* const nvenc_cbr[] = {
+    "rc", "cbr",
+    NULL,
+};
+
+static const encoder_t encoders[] = {
+    {"nvenc", "h264_nvenc", nvenc_options, nvenc_intra_refresh, nvenc_cbr, NULL},
+    {"x264", "libx264", x264_options, x264_intra_refresh, NULL, x264_roi},
+    {"x265", "libx265", x265_options, x265_intra_refresh, NULL, no_options},
+    {"vp8", "libvpx", vp8_options, NULL, NULL, no_options},
+};
+
+const encoder_t* const encoder_auto[] = {
+    &encoders[0],
+    &encoders[1],
+    NULL,
+};
+
+const encoder_t* encoder_find(const char* name) {
+    for (int i = 0; i < sizeof encoders / sizeof *encoders; i++) {
+        if (strcmp(encoders[i].name, name) == 0 || strcmp(encoders[i].codec_name, name) == 0)
+            return &encoders[i];
+    }
+    return NULL;
+}
+
+void encoder_list(FILE* out) {
+    for (int i = 0; i < sizeof encoders / sizeof *encoders; i++)
+        fprintf(out, "  %-8s (%s)\n", encoders[i].name, encoders[i].codec_name);
+}
+
+int encoder_open(const encoder_t* enc, AVCodecContext* c, int threads, const AVDictionary* user_opts) {
+    AVDictionary* opts = NULL;
+
+    for (const char* const* o = enc->options; *o != NULL; o += 2) {
+        if (c->bit_rate > 0 && (strcmp(o[0], "qp") == 0 || strcmp(o[0], "b") == 0))
+            continue;
+        av_dict_set(&opts, o[0], o[1], 0);
+    }
+    if (c->bit_rate > 0 && enc->cbr) {
+        for (const char* const* o = enc->cbr; *o != NULL; o += 2)
+            av_dict_set(&opts, o[0], o[1], 0);
+    }
+    av_dict_copy(&opts, user_opts, 0);
+
+    c->max_b_frames = 0;
+    c->thread_count = threads;
+
+    int err = avcodec_open2(c, c->codec, &opts);
+
+    AVDictionaryEntry* e = NULL;
+    while ((e = av_dict_get(opts, "", e, AV_DICT_IGNORE_SUFFIX)) != NULL)
+        fprintf(stderr, "encoder: %s: ignoring option %s=%s\n", enc->name, e->key, e->value);
+
+    av_dict_free(&opts);
+    return err;
+}
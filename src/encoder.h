@@ -0,0 +1,42 @@
+#ifndef _SCP_ENCODER_H
+#define _SCP_ENCODER_H
+
+#include <stdio.h>
+#include <libavcodec/avcodec.h>
+
+// An encoder backend: an FFmpeg encoder plus the defaults that keep its
+// latency down (no B-frames, no lookahead, slice threading where possible).
+typedef struct {
+    const char* name;
+    const char* codec_name;
+
+    // Codec options, as key/value pairs terminated by NULL
+    const char* const* options;
+
+    // Options replacing IDR frames by a rolling intra refresh, with the GOP
+    // size as its period; NULL if the backend has none
+    const char* const* intra_refresh;
+
+    // Options selecting constant bitrate, when a bit rate is set; NULL if the
+    // bit rate alone does
+    const char* const* cbr;
+
+    // Options under which the encoder applies regions of interest; NULL if
+    // it ignores them
+    const char* const* roi;
+} encoder_t;
+
+// Backends tried in order when none is requested.
+extern const encoder_t* const encoder_auto[];
+
+const encoder_t* encoder_find(const char* name);
+void encoder_list(FILE* out);
+
+// Applies the backend defaults to c, then the user options (may be NULL), and
+// opens it with the given number of threads, or one per core if 0. Options
+// not recognized by the encoder are reported and ignored. If c->bit_rate is
+// set, it replaces the default constant quality (qp) or bit rate (b) with
+// constant bitrate, rc_max_rate and rc_buffer_size bounding it.
+int encoder_open(const encoder_t* enc, AVCodecContext* c, int threads, const AVDictionary* user_opts);
+
+#endif
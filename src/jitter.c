@@ -0,0 +1,73 @@
+#include "jitter.h"
+
+#include <string.h>
+
+#define NANOSECS_PER_SEC 1000000000ll
+
+void jitter_init(jitter_t* j, int fps, double factor, long long max_delay) {
+    memset(j, 0, sizeof *j);
+    j->fps = fps;
+    j->factor = factor;
+    j->max_delay = max_delay;
+}
+
+long long jitter_delay(const jitter_t* j) {
+    long long delay = j->factor * j->jitter;
+    return delay < j->max_delay ? delay : j->max_delay;
+}
+
+static void restart(jitter_t* j, long long transit) {
+    j->started = true;
+    j->jitter = 0;
+    j->floor = j->window_min = j->last_window_min = transit;
+    j->window_frames = 0;
+}
+
+long long jitter_arrive(jitter_t* j, int64_t pts, long long arrival) {
+    if (j->started && pts == j->pts)
+        return j->playout;
+
+    long long transit = arrival - pts * NANOSECS_PER_SEC / j->fps;
+    long long d = transit - j->transit;
+
+    if (!j->started || pts < j->pts || d > JITTER_RESET_NS || d < -JITTER_RESET_NS) {
+        restart(j, transit);
+    } else {
+        j->jitter += ((d < 0 ? -d : d) - j->jitter) / JITTER_GAIN;
+
+        if (transit < j->window_min)
+            j->window_min = transit;
+        if (++j->window_frames == (unsigned long)JITTER_WINDOW_SECONDS * j->fps) {
+            j->last_window_min = j->window_min;
+            j->window_min = transit;
+            j->window_frames = 0;
+        }
+        j->floor = j->window_min < j->last_window_min ? j->window_min : j->last_window_min;
+    }
+
+    j->pts = pts;
+    j->transit = transit;
+
+    long long playout = arrival + (j->floor - transit) + jitter_delay(j);
+    if (playout < arrival) {
+        playout = arrival;
+        j->stats.late++;
+    }
+    if (playout > arrival + j->max_delay)
+        playout = arrival + j->max_delay;
+    j->playout = playout;
+
+    j->stats.jitter_sum += j->jitter;
+    j->stats.delay_sum += playout - arrival;
+    if (playout - arrival > j->stats.delay_max)
+        j->stats.delay_max = playout - arrival;
+    j->stats.frames++;
+
+    return playout;
+}
+
+jitter_stats_t jitter_stats(jitter_t* j) {
+    jitter_stats_t s = j->stats;
+    memset(&j->stats, 0, sizeof j->stats);
+    return s;
+}
@@ -0,0 +1,63 @@
+#ifndef _SCP_JITTER_H
+#define _SCP_JITTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Weight of a new transit sample in the jitter estimate (RFC 3550)
+#define JITTER_GAIN 16
+
+// The transit floor is the minimum over the last two windows of this length,
+// so it follows clock drift and route changes.
+#define JITTER_WINDOW_SECONDS 2
+
+// Transit changes past this are a discontinuity (scp restarted), not jitter
+#define JITTER_RESET_NS 1000000000ll
+
+typedef struct {
+    long long jitter_sum;            // Jitter estimate, in ns, per frame
+    long long delay_sum, delay_max;  // Time spent buffered, in ns
+    unsigned long frames;
+    unsigned long late;              // Frames that arrived past their playout time
+} jitter_stats_t;
+
+// Playout buffer keyed by pts, in a 1/fps time base. Frame n plays at
+//
+//     floor + n / fps + delay
+//
+// where floor is the smallest transit time (arrival - n / fps) seen lately,
+// so the fastest frames wait exactly delay. The delay is the inter-arrival
+// jitter times factor, capped at max_delay: factor trades latency for
+// smoothness, and max_delay bounds it for interactive use. No frame is ever
+// held longer than max_delay past its arrival.
+typedef struct {
+    int fps;
+    double factor;
+    long long max_delay;
+
+    bool started;
+    int64_t pts;        // Of the last frame
+    long long playout;  // Of the last frame
+    long long transit;  // Of the last frame
+    long long jitter;
+
+    long long floor, window_min, last_window_min;
+    unsigned long window_frames;
+
+    jitter_stats_t stats;
+} jitter_t;
+
+// Times are in ns of CLOCK_MONOTONIC.
+void jitter_init(jitter_t* j, int fps, double factor, long long max_delay);
+
+// Registers the arrival of part of frame pts and returns when the frame
+// should play. Later parts of the frame last seen get the same time.
+long long jitter_arrive(jitter_t* j, int64_t pts, long long arrival);
+
+// Current target delay, in ns.
+long long jitter_delay(const jitter_t* j);
+
+// Returns the statistics since the last call, and resets them.
+jitter_stats_t jitter_stats(jitter_t* j);
+
+#endif
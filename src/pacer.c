@@ -0,0 +1,62 @@
+#include "pacer.h"
+
+#include <errno.h>
+#include <string.h>
+
+#define NANOSECS_PER_SEC 1000000000ll
+
+static long long timespec_ns(const struct timespec* t) {
+    return t->tv_sec * NANOSECS_PER_SEC + t->tv_nsec;
+}
+
+// Deadline of a tick, in ns since the epoch. Exact, no per-tick rounding.
+static long long tick_offset(const pacer_t* p, int64_t tick) {
+    return tick * NANOSECS_PER_SEC / p->fps;
+}
+
+void pacer_init(pacer_t* p, int fps, pacer_policy_t policy) {
+    clock_gettime(CLOCK_MONOTONIC, &p->epoch);
+    p->fps = fps;
+    p->policy = policy;
+    p->tick = 0;
+    memset(&p->stats, 0, sizeof p->stats);
+}
+
+int64_t pacer_wait(pacer_t* p) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long long epoch = timespec_ns(&p->epoch);
+    long long elapsed = timespec_ns(&now) - epoch;
+
+    // Slot the clock is currently in; anything before it is late
+    int64_t current = elapsed * p->fps / NANOSECS_PER_SEC;
+    int64_t limit = p->policy == PACER_CATCHUP ? current - PACER_MAX_BURST : current;
+    if (p->tick < limit) {
+        p->stats.skipped += limit - p->tick;
+        p->tick = limit;
+    }
+
+    long long deadline = epoch + tick_offset(p, p->tick);
+    struct timespec ts = {
+        .tv_sec = deadline / NANOSECS_PER_SEC,
+        .tv_nsec = deadline % NANOSECS_PER_SEC,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long late = timespec_ns(&now) - deadline;
+    p->stats.late_sum += late;
+    if (late > p->stats.late_max)
+        p->stats.late_max = late;
+    p->stats.ticks++;
+
+    return p->tick++;
+}
+
+pacer_stats_t pacer_stats(pacer_t* p) {
+    pacer_stats_t s = p->stats;
+    memset(&p->stats, 0, sizeof p->stats);
+    return s;
+}
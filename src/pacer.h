@@ -0,0 +1,42 @@
+#ifndef _SCP_PACER_H
+#define _SCP_PACER_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Number of late ticks run back to back under PACER_CATCHUP before the
+// pacer gives up and skips ahead anyway.
+#define PACER_MAX_BURST 4
+
+typedef enum {
+    PACER_SKIP,    // Late ticks are dropped, the next one runs on its slot
+    PACER_CATCHUP, // Late ticks run immediately, up to PACER_MAX_BURST
+} pacer_policy_t;
+
+typedef struct {
+    long long late_sum, late_max; // Wake-up lateness past the deadline, in ns
+    unsigned long ticks;
+    unsigned long skipped;
+} pacer_stats_t;
+
+// Paces ticks at a fixed rate. Tick n is due at epoch + n / fps, computed
+// from the epoch every time, so sleeping late never shifts later deadlines.
+typedef struct {
+    struct timespec epoch;
+    int fps;
+    pacer_policy_t policy;
+
+    int64_t tick; // Next tick to run
+    pacer_stats_t stats;
+} pacer_t;
+
+void pacer_init(pacer_t* p, int fps, pacer_policy_t policy);
+
+// Sleeps until the next tick is due and returns its number. Under
+// PACER_SKIP, ticks whose slot has already passed are skipped.
+int64_t pacer_wait(pacer_t* p);
+
+// Returns the statistics since the last call, and resets them.
+pacer_stats_t pacer_stats(pacer_t* p);
+
+#endif
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/XShm.h>
@@ -21,6 +22,11 @@
 #include "piu/PIUSocket.h"
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "jitter.h"
+#include "ring.h"
+#include "stream.h"
 
 #define WIDTH 1920
 #define HEIGHT 1080
@@ -28,11 +34,26 @@
 #define NANOSECS_PER_FRAME 16666667
 #define DECODER_NAME "h264"
 #define FIFO "./fifo"
+#define REPORT_SECONDS 5
 
 #define INBUF_SIZE 82768
 uint8_t inbuf[INBUF_SIZE + AV_INPUT_BUFFER_PADDING_SIZE];
 int fd;
 
+// Access units read ahead of the decoder, including the ones held by the
+// jitter buffer
+#define UNIT_QUEUE_SIZE 256
+
+// Jitter buffer defaults: the playout delay is JITTER_FACTOR times the
+// measured jitter, up to JITTER_MAX_DELAY_MS
+#define JITTER_FACTOR 3.0
+#define JITTER_MAX_DELAY_MS 50
+#define NANOSECS_PER_SEC 1000000000ll
+
+// Keyframe requests for a stripe are at least this far apart, so a loss is
+// reported once while its keyframe is on the way
+#define KEY_REQUEST_INTERVAL_MS 100
+
 typedef struct {
     enum { MEASURE_ENCODER, MEASURE_DECODER } type;
     int pts;
@@ -47,6 +68,13 @@ static void die(const char *errstr, ...) {
     exit(1);
 }
 
+static long long monotonic_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (long long)time.tv_sec * NANOSECS_PER_SEC + time.tv_nsec;
+}
+
 static long long monotonic_clock() {
     struct timespec time;
     clock_gettime(CLOCK_MONOTONIC, &time);
@@ -77,7 +105,178 @@ static void measure_cpu(Bool end) {
     }
 }
 
-static void decode(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt, SDL_Texture* texture) {
+// SDL texture format of a decoder output format, or 0 if there is none.
+static Uint32 texture_format(enum AVPixelFormat fmt) {
+    switch (fmt) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        return SDL_PIXELFORMAT_IYUV;
+    case AV_PIX_FMT_NV12:
+        return SDL_PIXELFORMAT_NV12;
+    default:
+        return 0;
+    }
+}
+
+// Textures of the recent picture formats and sizes, so a stream switching
+// resolution back and forth (adaptive streaming) does not recreate them.
+#define TEXTURE_POOL_SIZE 4
+
+static struct {
+    SDL_Texture* texture;
+    Uint32 format;
+    int width, height;
+    unsigned long used;
+} textures[TEXTURE_POOL_SIZE];
+static unsigned long texture_clock;
+
+// Returns the pooled texture of this format and size, creating it in place of
+// the least recently used one if there is none.
+static SDL_Texture* pool_texture(SDL_Renderer* renderer, Uint32 format, int width, int height) {
+    int lru = 0;
+    for (int i = 0; i < TEXTURE_POOL_SIZE; i++) {
+        if (textures[i].texture && textures[i].format == format &&
+            textures[i].width == width && textures[i].height == height) {
+            textures[i].used = ++texture_clock;
+            return textures[i].texture;
+        }
+        if (textures[i].used < textures[lru].used)
+            lru = i;
+    }
+
+    SDL_DestroyTexture(textures[lru].texture);
+    textures[lru].texture = SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STREAMING, width, height);
+    if (!textures[lru].texture) {
+        die("nao carregou a texture!\n");
+    }
+    textures[lru].format = format;
+    textures[lru].width = width;
+    textures[lru].height = height;
+    textures[lru].used = ++texture_clock;
+    return textures[lru].texture;
+}
+
+static void pool_free() {
+    for (int i = 0; i < TEXTURE_POOL_SIZE; i++) {
+        SDL_DestroyTexture(textures[i].texture);
+        textures[i].texture = NULL;
+    }
+}
+
+// Uploads the frame into rect of the texture (NULL for all of it), reading
+// the planes with the decoder strides; SDL copies whole rows.
+static void upload_frame(SDL_Texture* texture, const SDL_Rect* rect, const AVFrame* f) {
+    int err;
+    if (f->format == AV_PIX_FMT_NV12)
+        err = SDL_UpdateNVTexture(texture, rect, f->data[0], f->linesize[0], f->data[1], f->linesize[1]);
+    else
+        err = SDL_UpdateYUVTexture(texture, rect, f->data[0], f->linesize[0], f->data[1], f->linesize[1],
+                                   f->data[2], f->linesize[2]);
+
+    if (err < 0) {
+        fprintf(stderr, "Failed to update texture: %s\n", SDL_GetError());
+    }
+}
+
+static Uint32 frame_texture_format(const AVFrame* f) {
+    Uint32 format = texture_format(f->format);
+    if (format == 0) {
+        die("unsupported decoder output: %s\n", av_get_pix_fmt_name(f->format));
+    }
+    return format;
+}
+
+
+// Decoded pictures go from the decode thread to the main thread through a
+// mailbox where the latest picture wins: the decoder never waits for the
+// screen, and the screen skips the pictures it was too slow for.
+#define MAILBOX_SIZE 3
+
+// A decoded picture: one frame per stripe, each going into its rows of the
+// texture
+typedef struct {
+    AVFrame* frames[STREAM_MAX_STRIPES];
+    SDL_Rect rects[STREAM_MAX_STRIPES];
+    int count;
+    int width, height;
+} picture_t;
+
+static picture_t pictures[MAILBOX_SIZE];
+static void* picture_items[MAILBOX_SIZE];
+static frame_ring_t mailbox;
+
+// SDL event sent when a picture is published, at most one in flight
+static Uint32 picture_event;
+static atomic_bool picture_notified;
+
+static void clear_picture(picture_t* pic) {
+    for (int i = 0; i < pic->count; i++)
+        av_frame_unref(pic->frames[i]);
+    pic->count = 0;
+}
+
+static picture_t* acquire_picture(int width, int height) {
+    picture_t* pic = frame_ring_acquire(&mailbox);
+    clear_picture(pic);
+    pic->width = width;
+    pic->height = height;
+    return pic;
+}
+
+static void publish_picture(picture_t* pic) {
+    frame_ring_publish(&mailbox, pic);
+
+    if (!atomic_exchange(&picture_notified, true)) {
+        SDL_Event e = {.type = picture_event};
+        SDL_PushEvent(&e);
+    }
+}
+
+// Packets sent to a decoder and frames it returned. Their difference as a
+// frame comes out is how many frames the decoder buffers.
+typedef struct {
+    long sent, received;
+} dec_queue_t;
+
+static struct {
+    unsigned long frames;
+    long sum;
+    long max;
+    unsigned long dropped; // Mailbox drops at the last report
+} depth;
+
+// Called by the decode thread for each picture, with the deepest queue of the
+// decoders that made it.
+static void report_depth(long d) {
+    depth.frames++;
+    depth.sum += d;
+    if (d > depth.max)
+        depth.max = d;
+
+    if (depth.frames % (REPORT_SECONDS * FPS) == 0) {
+        unsigned long dropped = atomic_load(&mailbox.dropped);
+        fprintf(stderr, "player: decoder queue avg %.2f, max %ld frames; %lu pictures dropped\n",
+                (double)depth.sum / depth.frames, depth.max, dropped - depth.dropped);
+        depth.dropped = dropped;
+    }
+}
+
+// Low-delay decoding. Frame threads hold a frame each, so only slice threads
+// are used, which need several slices per frame to help.
+static void configure_decoder(AVCodecContext* c, int threads) {
+    c->pkt_timebase = (AVRational){1, FPS};
+    c->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    c->flags2 |= AV_CODEC_FLAG2_FAST;
+    c->thread_type = FF_THREAD_SLICE;
+    c->thread_count = threads > 0 ? threads : 1;
+}
+
+static int cpu_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+static void decode(AVCodecContext *dec_ctx, dec_queue_t* q, AVFrame *frame, AVPacket *pkt) {
     int ret;
 
     ret = avcodec_send_packet(dec_ctx, pkt);
@@ -85,6 +284,7 @@ static void decode(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt, SDL_T
         fprintf(stderr, "Error sending a packet for decoding\n");
         exit(1);
     }
+    q->sent++;
 
     while (ret >= 0) {
         ret = avcodec_receive_frame(dec_ctx, frame);
@@ -93,6 +293,8 @@ static void decode(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt, SDL_T
         else if (ret < 0) {
             die("Error during decoding\n");
         }
+        q->received++;
+        report_depth(q->sent - q->received);
 
         measure_t m;
         m.pts = frame->coded_picture_number;
@@ -100,44 +302,629 @@ static void decode(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt, SDL_T
 
         if (fd != -1)
             write(fd, &m, sizeof m);
-        int size[] = {frame->width * frame->height, (frame->width * frame->height)/4, (frame->width * frame->height)/4};
 
-        // printf("%s\n", av_get_pix_fmt_name(frame->format));
-     
-        uint8_t* pixels;
-        int pitch;
+        picture_t* pic = acquire_picture(frame->width, frame->height);
+        pic->rects[0] = (SDL_Rect){0, 0, frame->width, frame->height};
+        av_frame_move_ref(pic->frames[0], frame);
+        pic->count = 1;
+        publish_picture(pic);
+    }
+}
+
+static void stop_loop() {
+    piu_stop_loop();
+}
+
+// Framed stream (scp --framed or --stripes, or over piu): whole access units
+// behind a stream header, so packets go to the decoder as soon as they are
+// read, with no parser. There is one decoder per stripe, on its own thread,
+// and each stripe is decoded as soon as it arrives, while the rest of the
+// frame is still on the way. The stripes are put back together in the
+// texture.
+typedef struct {
+    AVCodecContext* c;
+    AVPacket* pkt;
+    AVFrame* frame;
+    AVFrame* last; // Latest picture of the stripe
+    dec_queue_t queue;
+    int y, rows;
+
+    bool queued;  // pkt is part of the current frame
+    bool go;      // pkt waits for the stripe thread
+    bool key;     // pkt is a keyframe
+    bool decoded; // frame holds a picture to upload
+
+    // A packet was lost or failed to decode: pictures are corrupt until the
+    // next keyframe, and are not shown
+    bool lost;
+    bool lost_unit; // Reported lost, applied once the stripe is idle; decode thread only
+
+    pthread_t thread;
+} stripe_dec_t;
+
+static struct {
+    stripe_dec_t stripes[STREAM_MAX_STRIPES];
+    int count;
+    int width, height;
+    enum AVCodecID codec;
+
+    int64_t pts; // Of the queued packets
+    int queued;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    int pending; // Stripes being decoded
+    bool quit;
+} striped;
+
+// scp to read access units from, or NULL for stdin
+static PIUSocket* peer = NULL;
+static stream_reader_t reader;
+static bool framed = false;
+
+// Last keyframe request per stripe, the last one for all stripes
+static long long key_requests[STREAM_MAX_STRIPES + 1];
+static pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Decode thread only
+static jitter_t jitter;
+static double jitter_factor = JITTER_FACTOR;
+static long long jitter_max_delay = JITTER_MAX_DELAY_MS * 1000000ll;
+
+// Raw bitstream: parsed by the input thread, decoded by the decode thread
+static struct {
+    AVCodecParserContext* parser;
+    AVCodecContext* parser_ctx;
+    AVCodecContext* c;
+    AVFrame* frame;
+    dec_queue_t queue;
+} raw;
+
+typedef struct {
+    stream_header_t h; // Framed only
+    AVPacket* pkt;     // NULL at the end of the input, unless lost
+    bool lost;         // The access unit of h was cut short
+    long long arrival; // Monotonic ns, when the unit was read in full
+} unit_t;
+
+static struct {
+    unit_t items[UNIT_QUEUE_SIZE];
+    int head, count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t put, taken;
+} units = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .put = PTHREAD_COND_INITIALIZER,
+    .taken = PTHREAD_COND_INITIALIZER,
+};
+
+static bool read_full(int fd, void* buf, size_t size) {
+    uint8_t* p = buf;
+
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool read_header(stream_header_t* h) {
+    if (peer != NULL) {
+        stream_recv_header(&reader, h);
+        return true;
+    }
+
+    uint8_t buf[STREAM_HEADER_SIZE];
+    if (!read_full(STDIN_FILENO, buf, sizeof buf))
+        return false;
+    if (!stream_header_unpack(h, buf)) {
+        die("invalid stripe header\n");
+    }
+    return true;
+}
+
+// Reads the payload straight into the packet buffer
+static stream_status_t read_payload(const stream_header_t* h, AVPacket* pkt) {
+    av_packet_unref(pkt);
+    if (av_new_packet(pkt, h->size) < 0) {
+        die("failed to allocate packet\n");
+    }
+    pkt->pts = h->pts;
+
+    if (peer != NULL)
+        return stream_recv_payload(&reader, h, pkt->data);
+    return read_full(STDIN_FILENO, pkt->data, h->size) ? STREAM_OK : STREAM_CLOSED;
+}
+
+// Sends a picture loss indication to scp, which answers with a keyframe of
+// the stripe. Nothing to do without a peer.
+static void request_key(int index, int64_t pts) {
+    if (peer == NULL)
+        return;
+
+    int slot = index == STREAM_ALL_STRIPES ? STREAM_MAX_STRIPES : index;
+    long long now = monotonic_ns();
+
+    pthread_mutex_lock(&key_lock);
+    bool due = now - key_requests[slot] >= KEY_REQUEST_INTERVAL_MS * 1000000ll;
+    if (due)
+        key_requests[slot] = now;
+    pthread_mutex_unlock(&key_lock);
+
+    if (!due)
+        return;
+
+    stream_feedback_t fb = {
+        .type = STREAM_FEEDBACK_PLI,
+        .index = index,
+        .pts = pts,
+    };
+    if (!stream_send_feedback(peer, &fb))
+        fprintf(stderr, "player: failed to request a keyframe\n");
+}
 
-        if (SDL_LockTexture(texture, NULL, (void**)&pixels, &pitch) < 0) {
-            die("Failed to lock texture: %s\n");
+static void decode_stripe(stripe_dec_t* st) {
+    st->decoded = false;
+    if (st->key)
+        st->lost = false;
+
+    if (avcodec_send_packet(st->c, st->pkt) < 0) {
+        fprintf(stderr, "Error sending a packet for decoding\n");
+        st->lost = true;
+        return;
+    }
+    st->queue.sent++;
+
+    int ret = 0;
+    while (ret >= 0) {
+        ret = avcodec_receive_frame(st->c, st->frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            break;
+        else if (ret < 0) {
+            fprintf(stderr, "Error during decoding\n");
+            st->lost = true;
+            break;
         }
+        st->queue.received++;
+
+        if (st->frame->decode_error_flags || (st->frame->flags & AV_FRAME_FLAG_CORRUPT))
+            st->lost = true;
+        st->decoded = !st->lost;
+    }
+}
+
+static void* stripe_worker(void* arg) {
+    stripe_dec_t* st = arg;
+
+    pthread_mutex_lock(&striped.lock);
+    for (;;) {
+        while (!st->go && !striped.quit)
+            pthread_cond_wait(&striped.start, &striped.lock);
+        if (striped.quit)
+            break;
+        st->go = false;
+        pthread_mutex_unlock(&striped.lock);
+
+        decode_stripe(st);
+
+        pthread_mutex_lock(&striped.lock);
+        if (--striped.pending == 0)
+            pthread_cond_signal(&striped.done);
+    }
+    pthread_mutex_unlock(&striped.lock);
+    return NULL;
+}
+
+static void striped_setup(const stream_header_t* h) {
+    const AVCodec* codec = avcodec_find_decoder(h->codec);
+    if (!codec) {
+        die("no decoder for codec %u\n", h->codec);
+    }
+
+    striped.count = h->count;
+    striped.width = h->width;
+    striped.height = h->height;
+    striped.codec = h->codec;
+    striped.queued = 0;
+    striped.quit = false;
 
-        uint8_t* ptr = pixels;
+    pthread_mutex_init(&striped.lock, NULL);
+    pthread_cond_init(&striped.start, NULL);
+    pthread_cond_init(&striped.done, NULL);
 
-        for (int i = 0; i < 3; i++) {
-            for (int j = 0; j < size[i]; j++) {
-                *ptr++ = frame->data[i][j];
+    for (int i = 0; i < striped.count; i++) {
+        stripe_dec_t* st = &striped.stripes[i];
+
+        st->c = avcodec_alloc_context3(codec);
+        st->pkt = av_packet_alloc();
+        st->frame = av_frame_alloc();
+        st->last = av_frame_alloc();
+        if (!st->c || !st->pkt || !st->frame || !st->last) {
+            die("failed to allocate stripe decoder\n");
+        }
+        // Stripes are the parallelism, slices split the cores left
+        configure_decoder(st->c, cpu_count() / striped.count);
+        st->lost_unit = false;
+
+        int err = avcodec_open2(st->c, codec, NULL);
+        if (err < 0) {
+            die("failed to open codec: %s\n", av_err2str(err));
+        }
+
+        if (pthread_create(&st->thread, NULL, stripe_worker, st) != 0) {
+            die("failed to start decoder thread\n");
+        }
+    }
+}
+
+// Stops the stripe decoders. Pictures already published keep their frames.
+static void striped_teardown() {
+    pthread_mutex_lock(&striped.lock);
+    striped.quit = true;
+    pthread_cond_broadcast(&striped.start);
+    pthread_mutex_unlock(&striped.lock);
+
+    for (int i = 0; i < striped.count; i++) {
+        stripe_dec_t* st = &striped.stripes[i];
+
+        pthread_join(st->thread, NULL);
+        avcodec_free_context(&st->c);
+        av_packet_free(&st->pkt);
+        av_frame_free(&st->frame);
+        av_frame_free(&st->last);
+        st->queued = false;
+        st->go = false;
+        st->lost = false;
+        st->queue = (dec_queue_t){0};
+    }
+
+    pthread_mutex_destroy(&striped.lock);
+    pthread_cond_destroy(&striped.start);
+    pthread_cond_destroy(&striped.done);
+    striped.count = 0;
+}
+
+// Waits for the queued stripes to be decoded, and publishes the latest
+// picture of every stripe.
+static void striped_flush() {
+    if (striped.queued == 0)
+        return;
+
+    // A stripe with nothing in a frame that others have lost its packet
+    for (int i = 0; i < striped.count; i++) {
+        if (!striped.stripes[i].queued)
+            striped.stripes[i].lost = true;
+    }
+
+    pthread_mutex_lock(&striped.lock);
+    while (striped.pending > 0)
+        pthread_cond_wait(&striped.done, &striped.lock);
+    pthread_mutex_unlock(&striped.lock);
+
+    long d = 0;
+    picture_t* pic = acquire_picture(striped.width, striped.height);
+    for (int i = 0; i < striped.count; i++) {
+        stripe_dec_t* st = &striped.stripes[i];
+        if (st->lost_unit) {
+            st->lost = true;
+            st->lost_unit = false;
+        }
+        if (st->lost)
+            request_key(i, striped.pts);
+        if (st->queue.sent - st->queue.received > d)
+            d = st->queue.sent - st->queue.received;
+        if (st->queued && st->decoded) {
+            av_frame_unref(st->last);
+            av_frame_move_ref(st->last, st->frame);
+        }
+        st->queued = false;
+
+        AVFrame* f = st->last;
+        if (f->data[0] == NULL)
+            continue;
+
+        SDL_Rect rect = {0, st->y, striped.width, st->rows};
+        if (f->width < rect.w)
+            rect.w = f->width;
+        if (f->height < rect.h)
+            rect.h = f->height;
+
+        pic->rects[pic->count] = rect;
+        if (av_frame_ref(pic->frames[pic->count++], f) < 0) {
+            die("failed to reference stripe frame\n");
+        }
+    }
+    publish_picture(pic);
+    report_depth(d);
+
+    measure_t m;
+    m.pts = striped.pts;
+    m.type = MEASURE_DECODER;
+
+    if (fd != -1)
+        write(fd, &m, sizeof m);
+
+    striped.queued = 0;
+}
+
+// Starts decoding one access unit (a stripe packet), taking its data, and
+// publishes the frame once it is complete.
+static void striped_unit(const stream_header_t* h, AVPacket* pkt) {
+    // A new size or stripe count (the sender adapting its resolution) comes
+    // with new encoders, hence new decoders
+    if (striped.count > 0 && (h->count != striped.count || h->width != striped.width ||
+                              h->height != striped.height || h->codec != striped.codec)) {
+        striped_flush();
+        striped_teardown();
+    }
+    if (striped.count == 0)
+        striped_setup(h);
+
+    // A packet from another frame, or a second one for the same stripe, ends
+    // the frame even if some stripe had nothing to send
+    stripe_dec_t* st = &striped.stripes[h->index];
+    if (striped.queued > 0 && (h->pts != striped.pts || st->queued))
+        striped_flush();
+
+    av_packet_unref(st->pkt);
+    av_packet_move_ref(st->pkt, pkt);
+    st->y = h->y;
+    st->rows = h->rows;
+    st->queued = true;
+    st->key = h->flags & STREAM_FLAG_KEY;
+    striped.pts = h->pts;
+    striped.queued++;
+
+    pthread_mutex_lock(&striped.lock);
+    st->go = true;
+    striped.pending++;
+    pthread_cond_broadcast(&striped.start);
+    pthread_mutex_unlock(&striped.lock);
+
+    if (striped.queued == striped.count)
+        striped_flush();
+}
+
+// The access unit of h never made it: its stripe is corrupt until the
+// keyframe requested here. A stripe with a unit queued may still be
+// decoding it, so the loss is marked once that frame is flushed.
+static void striped_lost(const stream_header_t* h) {
+    fprintf(stderr, "player: lost stripe %d at pts %lld\n", h->index, (long long)h->pts);
+
+    if (striped.count == h->count && striped.width == h->width && striped.height == h->height) {
+        stripe_dec_t* st = &striped.stripes[h->index];
+        if (st->queued)
+            st->lost_unit = true;
+        else
+            st->lost = true;
+    }
+    request_key(h->index, h->pts);
+}
+
+static void unit_push(const unit_t* u) {
+    pthread_mutex_lock(&units.lock);
+    while (units.count == UNIT_QUEUE_SIZE)
+        pthread_cond_wait(&units.taken, &units.lock);
+
+    units.items[(units.head + units.count) % UNIT_QUEUE_SIZE] = *u;
+    units.count++;
+    pthread_cond_signal(&units.put);
+    pthread_mutex_unlock(&units.lock);
+}
+
+static void unit_pop(unit_t* u) {
+    pthread_mutex_lock(&units.lock);
+    while (units.count == 0)
+        pthread_cond_wait(&units.put, &units.lock);
+
+    *u = units.items[units.head];
+    units.head = (units.head + 1) % UNIT_QUEUE_SIZE;
+    units.count--;
+    pthread_cond_signal(&units.taken);
+    pthread_mutex_unlock(&units.lock);
+}
+
+// Reads access units until the end of the input, which is queued as a unit
+// with no packet.
+static void* input_thread(void* arg) {
+    unit_t u = {0};
+
+    if (framed) {
+        while (read_header(&u.h)) {
+            u.pkt = av_packet_alloc();
+            if (!u.pkt) {
+                die("failed to allocate packet\n");
+            }
+            stream_status_t status = read_payload(&u.h, u.pkt);
+            if (status == STREAM_CLOSED) {
+                av_packet_free(&u.pkt);
+                break;
             }
+
+            u.lost = status == STREAM_CUT;
+            if (u.lost)
+                av_packet_free(&u.pkt);
+            u.arrival = monotonic_ns();
+            unit_push(&u);
+        }
+    } else {
+        AVPacket* parsed = av_packet_alloc();
+        if (!parsed) {
+            die("failed to allocate packet\n");
         }
 
-        SDL_UnlockTexture(texture);
+        int data_size;
+        while ((data_size = read(STDIN_FILENO, inbuf, INBUF_SIZE)) > 0) {
+            uint8_t *data = inbuf;
+            while (data_size > 0) {
+                int ret = av_parser_parse2(raw.parser, raw.parser_ctx, &parsed->data, &parsed->size, data,
+                        data_size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+
+                if (ret < 0) {
+                    die("Error while parsing\n");
+                }
+                data += ret;
+                data_size -= ret;
+
+                if (!parsed->size)
+                    continue;
+
+                // The parser owns parsed->data, so the unit gets a copy
+                u.pkt = av_packet_alloc();
+                if (!u.pkt || av_packet_ref(u.pkt, parsed) < 0) {
+                    die("failed to allocate packet\n");
+                }
+                unit_push(&u);
+            }
+        }
+        av_packet_free(&parsed);
     }
+
+    u.pkt = NULL;
+    u.lost = false;
+    unit_push(&u);
+    return NULL;
 }
 
-static void stop_loop() {
-    piu_stop_loop();
+static void sleep_until(long long t) {
+    struct timespec ts = {
+        .tv_sec = t / NANOSECS_PER_SEC,
+        .tv_nsec = t % NANOSECS_PER_SEC,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+// Holds each framed access unit until the playout time of its pts, so frames
+// are decoded and shown at the pace they were captured at. A raw bitstream
+// has no pts and is decoded as it comes.
+static void jitter_hold(const unit_t* u) {
+    int fps = u->h.fps ? u->h.fps : FPS;
+    if (fps != jitter.fps)
+        jitter_init(&jitter, fps, jitter_factor, jitter_max_delay);
+
+    sleep_until(jitter_arrive(&jitter, u->h.pts, u->arrival));
+
+    if (jitter.stats.frames == (unsigned long)REPORT_SECONDS * fps) {
+        jitter_stats_t st = jitter_stats(&jitter);
+        fprintf(stderr, "player: jitter %.1f ms, playout delay avg %.1f ms, max %.1f ms, %lu frames late\n",
+                st.jitter_sum / (double)st.frames / 1e6, st.delay_sum / (double)st.frames / 1e6,
+                st.delay_max / 1e6, st.late);
+
+        if (peer != NULL) {
+            static PIUStats last;
+            PIUStats ps;
+            piu_socket_stats(peer, &ps);
+            if (ps.recv_calls != last.recv_calls)
+                fprintf(stderr, "player: %.1f datagrams per receive (batch %d%s)\n",
+                        (double)(ps.recv_datagrams - last.recv_datagrams) / (ps.recv_calls - last.recv_calls),
+                        ps.batch_size, ps.gro ? ", gro" : "");
+            last = ps;
+        }
+    }
+}
+
+static void* decode_thread(void* arg) {
+    for (;;) {
+        unit_t u;
+        unit_pop(&u);
+        if (u.lost) {
+            striped_lost(&u.h);
+            continue;
+        }
+        if (u.pkt == NULL)
+            break;
+
+        if (framed) {
+            jitter_hold(&u);
+            striped_unit(&u.h, u.pkt);
+        } else
+            decode(raw.c, &raw.queue, raw.frame, u.pkt);
+        av_packet_free(&u.pkt);
+    }
+
+    SDL_Event e = {.type = SDL_QUIT};
+    SDL_PushEvent(&e);
+    return NULL;
+}
+
+// Uploads the newest picture into the pooled texture of its format and size,
+// dropping any older one not presented yet, and points *texture to it.
+// Returns false if there was no new picture.
+static bool present_latest(SDL_Renderer* renderer, SDL_Texture** texture) {
+    // Cleared first, so a picture published from now on sends a new event
+    atomic_store(&picture_notified, false);
+
+    picture_t* pic = frame_ring_latest(&mailbox);
+    if (!pic)
+        return false;
+
+    if (pic->count > 0) {
+        Uint32 format = frame_texture_format(pic->frames[0]);
+        *texture = pool_texture(renderer, format, pic->width, pic->height);
+
+        for (int i = 0; i < pic->count; i++) {
+            AVFrame* f = pic->frames[i];
+            if (frame_texture_format(f) != format) {
+                fprintf(stderr, "player: stripe %d format differs, skipped\n", i);
+                continue;
+            }
+            upload_frame(*texture, &pic->rects[i], f);
+        }
+    }
+
+    // The texture has its own copy, the decoder buffers can go back
+    clear_picture(pic);
+    frame_ring_release(&mailbox, pic);
+    return true;
 }
 
 int main(int argc, char* argv[]) {
     fd = -1;
-    char* ip = "127.0.0.1";
+    char* ip = NULL;
+    int port = STREAM_PORT;
 
     for (int i = 1; i < argc; i++) {
         if ((strcmp(argv[i], "--measure") == 0 || strcmp(argv[1], "-m") == 0))
             fd = open(FIFO, O_WRONLY);
+        else if (strcmp(argv[i], "--framed") == 0 || strcmp(argv[i], "-f") == 0 ||
+                 strcmp(argv[i], "--stripes") == 0 || strcmp(argv[i], "-t") == 0)
+            framed = true;
+        else if ((strcmp(argv[i], "--port") == 0 || strcmp(argv[i], "-p") == 0) && i + 1 < argc)
+            port = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--jitter") == 0 || strcmp(argv[i], "-j") == 0) && i + 1 < argc)
+            jitter_factor = atof(argv[++i]);
+        else if ((strcmp(argv[i], "--max-delay") == 0 || strcmp(argv[i], "-d") == 0) && i + 1 < argc)
+            jitter_max_delay = atoi(argv[++i]) * 1000000ll;
+        else if ((strcmp(argv[i], "--batch") == 0 || strcmp(argv[i], "-b") == 0) && i + 1 < argc)
+            piu_set_batch_size(atoi(argv[++i]));
         else
             ip = argv[i];
     }
 
+    if (jitter_factor < 0 || jitter_max_delay < 0) {
+        die("player: the jitter factor and the maximum delay cannot be negative\n");
+    }
+
+    // Given an address, access units come from scp over piu, always framed
+    if (ip != NULL) {
+        if (!piu_main_loop()) {
+            die("failed to start the piu loop\n");
+        }
+        atexit(stop_loop);
+
+        peer = piu_connect(ip, port);
+        if (!peer) {
+            die("failed to connect to %s:%d\n", ip, port);
+        }
+        stream_reader_init(&reader, peer);
+        framed = true;
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         die("nao inicializou o sdl!\n");
     }
@@ -151,90 +938,102 @@ int main(int argc, char* argv[]) {
     SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
     SDL_SetRenderDrawColor( renderer, 0xFF, 0xFF, 0xFF, 0xFF );
 
-    SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING, 1920, 1080);
-    if (!texture) {
-        die("nao carregou a texture!\n");
-    }
+    // Texture of the last presented picture, from the pool
+    SDL_Texture* texture = NULL;
 
-    AVCodec *codec = avcodec_find_decoder_by_name(DECODER_NAME);
-    if (!codec) {
-        die("failed to find encoder %s\n", DECODER_NAME);
+    picture_event = SDL_RegisterEvents(1);
+    if (picture_event == (Uint32)-1) {
+        die("failed to register the picture event\n");
     }
 
-    AVCodecParserContext *parser = av_parser_init(codec->id);
-    if (!parser) {
-        fprintf(stderr, "parser not found\n");
-        exit(1);
+    for (int i = 0; i < MAILBOX_SIZE; i++) {
+        for (int j = 0; j < STREAM_MAX_STRIPES; j++) {
+            pictures[i].frames[j] = av_frame_alloc();
+            if (!pictures[i].frames[j]) {
+                die("failed to allocate frame\n");
+            }
+        }
+        picture_items[i] = &pictures[i];
     }
-
-    memset(inbuf + INBUF_SIZE, 0, AV_INPUT_BUFFER_PADDING_SIZE);
-
-    AVCodecContext *c = avcodec_alloc_context3(codec);
-    if (!c) {
-        die("failed to allocate video codec context\n");
+    if (!frame_ring_init(&mailbox, picture_items, MAILBOX_SIZE)) {
+        die("failed to allocate the mailbox\n");
     }
-    c->pkt_timebase = (AVRational){1, FPS};
 
-    AVPacket *pkt = av_packet_alloc();
-    if (!pkt) {
-        die("failed to allocate packet\n");
-    }
+    // A raw bitstream is cut into packets by the parser, and decoded by a
+    // single decoder
+    if (!framed) {
+        AVCodec *codec = avcodec_find_decoder_by_name(DECODER_NAME);
+        if (!codec) {
+            die("failed to find encoder %s\n", DECODER_NAME);
+        }
 
-    AVFrame *frame = av_frame_alloc();
-    if (!frame) {
-        die("failed to allocate frame\n");
-    }
+        raw.parser = av_parser_init(codec->id);
+        if (!raw.parser) {
+            fprintf(stderr, "parser not found\n");
+            exit(1);
+        }
 
-    int err;
-    err = avcodec_open2(c, codec, NULL);
-    if (err < 0) {
-        die("failed to open codec: %s\n", av_err2str(err));
-    }
+        memset(inbuf + INBUF_SIZE, 0, AV_INPUT_BUFFER_PADDING_SIZE);
 
-    SDL_Event e;
+        // The parser updates its context, so it gets one of its own
+        raw.parser_ctx = avcodec_alloc_context3(codec);
+        raw.c = avcodec_alloc_context3(codec);
+        if (!raw.parser_ctx || !raw.c) {
+            die("failed to allocate video codec context\n");
+        }
+        configure_decoder(raw.c, cpu_count());
 
-    struct timespec frame_timespec = {
-        .tv_sec = 0,
-        .tv_nsec = NANOSECS_PER_FRAME,
-    };
+        raw.frame = av_frame_alloc();
+        if (!raw.frame) {
+            die("failed to allocate frame\n");
+        }
 
-    while(1) {
-        bool quit = false;
-        while (SDL_PollEvent( &e ) != 0) {
-            if (e.type == SDL_QUIT) {
-                quit = true;
-            }
+        int err = avcodec_open2(raw.c, codec, NULL);
+        if (err < 0) {
+            die("failed to open codec: %s\n", av_err2str(err));
         }
-        if (quit) break;
+    }
 
-        int data_size = read(STDIN_FILENO, inbuf, INBUF_SIZE);
+    pthread_t input_tid, decode_tid;
+    if (pthread_create(&input_tid, NULL, input_thread, NULL) != 0 ||
+        pthread_create(&decode_tid, NULL, decode_thread, NULL) != 0) {
+        die("failed to start threads\n");
+    }
 
-        uint8_t *data = inbuf;
-        while (data_size > 0) {
-            int ret = av_parser_parse2(parser, c, &pkt->data, &pkt->size, data,
-                    data_size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+    // Presents the newest picture whenever one is published; the window keeps
+    // responding while the input or the decoder stall
+    bool quit = false;
+    while (!quit) {
+        SDL_Event e;
+        if (!SDL_WaitEvent(&e)) {
+            die("SDL_WaitEvent: %s\n", SDL_GetError());
+        }
 
-            if (ret < 0) {
-                die("Error while parsing\n");
-            }
-            data += ret;
-            data_size -= ret;
+        bool fresh = false, redraw = false;
+        do {
+            if (e.type == SDL_QUIT)
+                quit = true;
+            else if (e.type == picture_event)
+                fresh = true;
+            else if (e.type == SDL_WINDOWEVENT)
+                redraw = true;
+        } while (SDL_PollEvent(&e));
 
-            if (pkt->size)
-                decode(c, frame, pkt, texture);
-        }
+        if (quit)
+            break;
+        if (fresh && present_latest(renderer, &texture))
+            redraw = true;
+        if (!redraw || !texture)
+            continue;
 
         SDL_RenderClear(renderer);
         SDL_RenderCopy(renderer, texture, NULL, NULL);
         SDL_RenderPresent(renderer);
     }
 
-    av_frame_free(&frame);
-    av_packet_free(&pkt);
-    avcodec_free_context(&c);
-    av_parser_close(parser);
-
-    SDL_DestroyTexture(texture);
+    // The input and decode threads may be blocked reading, so the socket and
+    // the decoders are left to the end of the process
+    pool_free();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     return 0;
@@ -0,0 +1,106 @@
+#include "rate.h"
+
+#include <string.h>
+
+#define RATE_DECREASE 0.85
+#define RATE_DECREASE_FAST 0.7 // When the delay is four times the target
+#define RATE_INCREASE 1.05
+#define RATE_MAX_LOSS 0.02
+
+void rate_init(rate_t* r, int64_t max_bitrate, int fps, int width, int height, int min_scale, int max_scale,
+               long long now) {
+    memset(r, 0, sizeof *r);
+    r->max_bitrate = max_bitrate;
+    r->fps = fps;
+    r->width = width;
+    r->height = height;
+    r->min_scale = min_scale;
+    r->max_scale = max_scale;
+
+    r->state.bitrate = max_bitrate / 2 > RATE_MIN_BITRATE ? max_bitrate / 2 : RATE_MIN_BITRATE;
+    r->state.divisor = 1;
+    r->state.scale = min_scale;
+
+    r->next = now + RATE_INTERVAL_MS;
+    r->stepped = now;
+}
+
+static double bits_per_pixel(const rate_t* r, const rate_state_t* s) {
+    double pixels = (double)(r->width / s->scale) * (r->height / s->scale);
+    return s->bitrate / (pixels * r->fps / s->divisor);
+}
+
+// Trades frame rate for pixels first: on screen content, a lower rate keeps
+// text readable where a lower scale does not.
+static bool step_down(const rate_t* r, rate_state_t* s) {
+    if (s->divisor < RATE_MAX_DIVISOR && r->fps / (s->divisor * 2) > 0) {
+        s->divisor *= 2;
+        return true;
+    }
+    if (s->scale < r->max_scale) {
+        s->scale++;
+        return true;
+    }
+    return false;
+}
+
+static bool step_up(const rate_t* r, rate_state_t* s) {
+    if (s->scale > r->min_scale) {
+        s->scale--;
+        return true;
+    }
+    if (s->divisor > 1) {
+        s->divisor /= 2;
+        return true;
+    }
+    return false;
+}
+
+bool rate_update(rate_t* r, const PIUStats* stats, long long now) {
+    if (now < r->next)
+        return false;
+    r->next = now + RATE_INTERVAL_MS;
+
+    uint64_t sent = stats->sent - r->sent;
+    uint64_t retransmitted = stats->retransmitted - r->retransmitted;
+    r->sent = stats->sent;
+    r->retransmitted = stats->retransmitted;
+
+    // Unacknowledged bytes take a round-trip to drain on an idle link, plus
+    // a frame sent in one burst; any more is queued somewhere
+    uint32_t delay = stats->rtt_us - stats->min_rtt_us;
+    int64_t drain = (int64_t)stats->queued_bytes * 8 * 1000000 / r->state.bitrate - stats->min_rtt_us -
+                    1000000ll * r->state.divisor / r->fps;
+    if (drain > delay)
+        delay = drain;
+
+    r->delay_us = delay;
+    r->loss = sent > 0 ? (double)retransmitted / sent : 0;
+
+    rate_state_t s = r->state;
+    if (delay > RATE_TARGET_DELAY_US || r->loss > RATE_MAX_LOSS)
+        s.bitrate *= delay > 4 * RATE_TARGET_DELAY_US ? RATE_DECREASE_FAST : RATE_DECREASE;
+    else if (delay < RATE_TARGET_DELAY_US / 2 && r->loss < RATE_MAX_LOSS / 4)
+        s.bitrate *= RATE_INCREASE;
+
+    if (s.bitrate < RATE_MIN_BITRATE)
+        s.bitrate = RATE_MIN_BITRATE;
+    if (s.bitrate > r->max_bitrate)
+        s.bitrate = r->max_bitrate;
+
+    if (now - r->stepped >= RATE_HOLD_MS) {
+        rate_state_t up = s;
+
+        if (bits_per_pixel(r, &s) < RATE_MIN_BPP) {
+            if (step_down(r, &s))
+                r->stepped = now;
+        } else if (step_up(r, &up) && bits_per_pixel(r, &up) >= 2 * RATE_MIN_BPP) {
+            s = up;
+            r->stepped = now;
+        }
+    }
+
+    bool changed = memcmp(&s, &r->state, sizeof s) != 0;
+    r->state = s;
+    return changed;
+}
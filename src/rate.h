@@ -0,0 +1,63 @@
+#ifndef _SCP_RATE_H
+#define _SCP_RATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "piu/PIUSocket.h"
+
+// Decisions are taken on this period, the statistics are averaged over it
+#define RATE_INTERVAL_MS 200
+
+// Queueing delay above which the link counts as congested
+#define RATE_TARGET_DELAY_US 20000
+
+#define RATE_MIN_BITRATE 250000
+
+// Below this many bits per pixel the frame rate, then the scale, goes down;
+// they come back once the bits per pixel stays above twice as many after
+// the change.
+#define RATE_MIN_BPP 0.02
+#define RATE_MAX_DIVISOR 4 // Frame rate divisor, a power of two
+#define RATE_HOLD_MS 2000  // Between two steps of the frame rate or scale
+
+typedef struct {
+    int64_t bitrate;
+    int divisor; // Every divisor-th tick is captured
+    int scale;
+} rate_state_t;
+
+// Congestion control on the bitrate, from the transport statistics: the
+// queueing delay (smoothed round-trip over the smallest one, and the time to
+// drain the unacknowledged bytes) and the share of retransmitted packets.
+// The bitrate drops multiplicatively on congestion and grows slowly
+// otherwise, so the delay stays steady rather than the quality. When the
+// bits left per pixel get too few, the frame rate and then the scale go down
+// too, and come back in the reverse order.
+typedef struct {
+    rate_state_t state;
+
+    int64_t max_bitrate;
+    int fps;
+    int width, height; // Unscaled
+    int min_scale, max_scale;
+
+    long long next;    // Of the next decision
+    long long stepped; // Of the last frame rate or scale step
+    uint64_t sent, retransmitted;
+
+    // Of the last decision
+    uint32_t delay_us;
+    double loss;
+} rate_t;
+
+// Times are in ms of CLOCK_MONOTONIC. The bitrate starts at half of the
+// maximum, the scale at min_scale.
+void rate_init(rate_t* r, int64_t max_bitrate, int fps, int width, int height, int min_scale, int max_scale,
+               long long now);
+
+// Feeds the current statistics of the connection. Returns true if the state
+// changed, at most once every RATE_INTERVAL_MS.
+bool rate_update(rate_t* r, const PIUStats* stats, long long now);
+
+#endif
@@ -0,0 +1,148 @@
+#include "ring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+bool ring_init(ring_t* ring, unsigned size) {
+    unsigned n = 1;
+    while (n < size)
+        n <<= 1;
+
+    ring->slots = calloc(n, sizeof(atomic_int));
+    if (ring->slots == NULL)
+        return false;
+
+    ring->mask = n - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return true;
+}
+
+void ring_free(ring_t* ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+bool ring_push(ring_t* ring, int value) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail > ring->mask)
+        return false;
+
+    atomic_store_explicit(&ring->slots[head & ring->mask], value, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool ring_pop(ring_t* ring, int* value) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    for (;;) {
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == head)
+            return false;
+
+        // The slot may be reused as soon as tail moves, so it is read before
+        // claiming it; a failed CAS discards the read.
+        int v = atomic_load_explicit(&ring->slots[tail & ring->mask], memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&ring->tail, &tail, tail + 1,
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            *value = v;
+            return true;
+        }
+    }
+}
+
+bool frame_ring_init(frame_ring_t* fr, void** items, int count) {
+    fr->items = items;
+    fr->count = count;
+    atomic_init(&fr->dropped, 0);
+
+    if (!ring_init(&fr->ready, count))
+        return false;
+
+    if (!ring_init(&fr->free, count)) {
+        ring_free(&fr->ready);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++)
+        ring_push(&fr->free, i);
+
+    sem_init(&fr->available, 0, 0);
+    return true;
+}
+
+void frame_ring_free(frame_ring_t* fr) {
+    ring_free(&fr->ready);
+    ring_free(&fr->free);
+    sem_destroy(&fr->available);
+}
+
+static int item_index(const frame_ring_t* fr, const void* item) {
+    for (int i = 0; i < fr->count; i++) {
+        if (fr->items[i] == item)
+            return i;
+    }
+
+    fprintf(stderr, "frame_ring: unknown item %p\n", item);
+    abort();
+}
+
+void* frame_ring_acquire(frame_ring_t* fr) {
+    int i;
+    if (ring_pop(&fr->free, &i))
+        return fr->items[i];
+
+    // The consumer holds one item and the producer none, so with count >= 3
+    // and nothing free there is at least one ready item to drop.
+    if (ring_pop(&fr->ready, &i)) {
+        atomic_fetch_add_explicit(&fr->dropped, 1, memory_order_relaxed);
+        return fr->items[i];
+    }
+
+    // The consumer released an item in between
+    while (!ring_pop(&fr->free, &i))
+        ;
+    return fr->items[i];
+}
+
+void frame_ring_publish(frame_ring_t* fr, void* item) {
+    ring_push(&fr->ready, item_index(fr, item));
+    sem_post(&fr->available);
+}
+
+void* frame_ring_take(frame_ring_t* fr) {
+    int i;
+
+    // Dropped items leave their post behind, hence the loop
+    do {
+        while (sem_wait(&fr->available) == -1 && errno == EINTR)
+            ;
+    } while (!ring_pop(&fr->ready, &i));
+
+    return fr->items[i];
+}
+
+void frame_ring_release(frame_ring_t* fr, void* item) {
+    ring_push(&fr->free, item_index(fr, item));
+}
+
+void* frame_ring_latest(frame_ring_t* fr) {
+    int i, next;
+    if (!ring_pop(&fr->ready, &i))
+        return NULL;
+
+    // Posts are only consumed to keep the count bounded; a post racing with
+    // the pop is left behind, which frame_ring_take() tolerates
+    sem_trywait(&fr->available);
+    while (ring_pop(&fr->ready, &next)) {
+        sem_trywait(&fr->available);
+        ring_push(&fr->free, i);
+        atomic_fetch_add_explicit(&fr->dropped, 1, memory_order_relaxed);
+        i = next;
+    }
+    return fr->items[i];
+}
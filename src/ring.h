@@ -0,0 +1,57 @@
+#ifndef _SCP_RING_H
+#define _SCP_RING_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Lock-free ring of item indices with a single producer and a single
+// consumer. Besides the consumer, the producer may also pop, to drop the
+// oldest entry: pops claim their slot with a CAS on tail.
+typedef struct {
+    atomic_uint head, tail;
+    unsigned mask;
+    atomic_int* slots;
+} ring_t;
+
+bool ring_init(ring_t* ring, unsigned size);
+void ring_free(ring_t* ring);
+
+bool ring_push(ring_t* ring, int value);
+bool ring_pop(ring_t* ring, int* value);
+
+// Hands preallocated items (frames, capture buffers) from one pipeline stage
+// to the next. Items cycle between the producer, the ready ring, the
+// consumer and the free ring, so nothing is allocated per frame.
+//
+// Drop policy: when the producer needs an item and none is free, the consumer
+// is lagging and the oldest ready item is dropped and reused. The producer
+// never blocks; the consumer blocks until an item is ready.
+typedef struct {
+    void** items;
+    int count;
+
+    ring_t ready, free;
+    sem_t available;
+
+    atomic_ulong dropped;
+} frame_ring_t;
+
+// Takes ownership of items (count >= 3, the producer and the consumer each
+// hold one item while working on it).
+bool frame_ring_init(frame_ring_t* fr, void** items, int count);
+void frame_ring_free(frame_ring_t* fr);
+
+// Producer side
+void* frame_ring_acquire(frame_ring_t* fr);
+void frame_ring_publish(frame_ring_t* fr, void* item);
+
+// Consumer side
+void* frame_ring_take(frame_ring_t* fr);
+void frame_ring_release(frame_ring_t* fr, void* item);
+
+// Consumer side, latest wins: returns the newest ready item without blocking,
+// or NULL if there is none. Older ready items are released as dropped.
+void* frame_ring_latest(frame_ring_t* fr);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <X11/Xlib.h>
@@ -9,21 +10,34 @@
 #include <X11/extensions/XShm.h>
 #include <sys/shm.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include "stb_image_write.h"
 #include <time.h>
 #include <byteswap.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include "piu/PIUSocket.h"
-
-#define WIDTH 1920
-#define HEIGHT 1080
-#define FPS 60
-#define NANOSECS_PER_FRAME 16666667
-#define CODEC_NAME "h264_nvenc"
+#include "convert.h"
+#include "encoder.h"
+#include "ring.h"
+#include "capture.h"
+#include "tiles.h"
+#include "pacer.h"
+#include "stream.h"
+#include "stripes.h"
+#include "rate.h"
+
+#define FPS 60 // Default frame rate
+#define BITRATE 20000000 // Default maximum bitrate when streaming to a player
+#define CONVERT_MAX_THREADS 4
+#define RING_DEPTH 2 // Frames queued between two pipeline stages
+#define REPORT_SECONDS 5
+#define KEEPALIVE_SECONDS 1 // Frame interval when the screen is idle (damage mode)
 #define FIFO "./fifo"
 int fd;
 
@@ -32,6 +46,50 @@ typedef struct {
     int pts;
 } measure_t;
 
+// Per-frame state, reached through frame->opaque
+typedef struct {
+    damage_t stale;  // Rows older than the last capture
+    uint32_t* tiles; // Tile hashes of the contents, with --roi
+} frame_info_t;
+
+// Capture -> convert -> encode. Stages run on their own threads and hand
+// buffers over through frame rings; in passthrough mode the encoder takes
+// the captures directly and there is no convert stage.
+static struct {
+    int fps;
+    pacer_policy_t late_policy;
+
+    // Set by the rate controller: every fps_divisor-th tick is captured, and
+    // converted frames are shrunk scale times
+    atomic_int fps_divisor;
+    atomic_int scale;
+
+    capture_source_t source;
+    convert_t cv;
+    bool passthrough;
+
+    capture_t captures[RING_DEPTH + 2];
+    AVFrame* frames[RING_DEPTH + 2];
+    frame_info_t frames_info[RING_DEPTH + 2];
+    frame_ring_t capture_ring, frame_ring;
+
+    stripes_t stripes;
+    AVDictionary* stripe_opts; // To reopen the stripes on a scale change
+    int64_t bitrate;           // Constant bitrate if set, constant quality otherwise
+    PIUSocket* peer; // Player to stream to, or NULL for stdout
+    bool framed;     // Stream headers on stdout
+
+    // No IDR frames after the first one, and slices per stripe
+    bool intra_refresh;
+    int slices;
+
+    // Tile change map, with --roi
+    bool roi;
+    bool refresh_tiles; // Set by keyframes
+    tile_grid_t grid;
+    uint32_t* captures_tiles[RING_DEPTH + 2];
+} pipeline;
+
 static void die(const char *errstr, ...) {
     va_list ap;
 
@@ -48,16 +106,6 @@ static long long monotonic_clock() {
     return (long long)time.tv_sec * 1000ll + time.tv_nsec / 1000000;
 }
 
-static void diff_timespec(struct timespec* res, const struct timespec *a, const struct timespec *b) {
-    res->tv_sec = a->tv_sec - b->tv_sec;
-    res->tv_nsec = a->tv_nsec - b->tv_nsec;
-
-    if (res->tv_nsec < 0) {
-        res->tv_nsec += 1000000000;
-        res->tv_sec--;
-    }
-}
-
 // Returns true if a < b
 int comp_timespec(const struct timespec *a, const struct timespec *b) {
     if (a->tv_sec == b->tv_sec)
@@ -66,19 +114,537 @@ int comp_timespec(const struct timespec *a, const struct timespec *b) {
     return a->tv_sec < b->tv_sec;
 }
 
+// Passthrough captures go back to the ring only once the encoders drop their
+// last reference to the shm memory, which may happen on an encoder thread.
+// The lock keeps a single producer on the free ring.
+static pthread_mutex_t capture_release_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int captures_held;
+
+static void shm_buffer_free(void *opaque, uint8_t *data) {
+    pthread_mutex_lock(&capture_release_lock);
+    frame_ring_release(&pipeline.capture_ring, opaque);
+    pthread_mutex_unlock(&capture_release_lock);
+    atomic_fetch_sub(&captures_held, 1);
+}
+
+static void usage() {
+    fprintf(stderr, "usage: scp [-m] [-d] [-r] [-g WxH+X+Y] [-w id] [-s n] [-t n] [-F] [-p port] [-f fps]\n"
+                    "           [-l policy] [-i] [-S n] [-b rate] [-B n] [-e encoder] [-o key=value]...\n"
+                    "  -m, --measure            write measure events to " FIFO "\n"
+                    "  -d, --damage             only capture and encode when the screen changes\n"
+                    "  -r, --roi                code unchanged tiles cheaply (region of interest;\n"
+                    "                           not with nvenc)\n"
+                    "  -g, --geometry WxH+X+Y   capture an area of the screen (or window)\n"
+                    "  -w, --window ID          capture a window instead of the screen\n"
+                    "  -s, --scale N            shrink frames N times (1 to %d)\n"
+                    "  -t, --stripes N          encode N horizontal stripes in parallel (1 to %d);\n"
+                    "                           implies --framed\n"
+                    "  -F, --framed             write whole access units behind a header, so the\n"
+                    "                           player needs no parser (player --framed)\n"
+                    "  -p, --port PORT          wait for a player on PORT and stream to it instead\n"
+                    "                           of writing to stdout (the player uses %d)\n"
+                    "  -f, --fps N              frame rate (default: %d)\n"
+                    "  -l, --late skip|catchup  late frames are skipped (default), or captured\n"
+                    "                           back to back, up to %d\n"
+                    "  -i, --intra-refresh      refresh the picture in a moving intra column over\n"
+                    "                           one second instead of sending IDR frames\n"
+                    "  -S, --slices N           slices per frame (per stripe), to spread the\n"
+                    "                           bits of each frame and decode it in parallel\n"
+                    "  -b, --bitrate RATE       constant bitrate in bit/s (k and M suffixes) instead\n"
+                    "                           of constant quality; with --port, the maximum of\n"
+                    "                           the bitrate, frame rate and scale adapting to the\n"
+                    "                           link (default: %dM)\n"
+                    "  -B, --batch N            datagrams per system call to the player (1 to %d,\n"
+                    "                           default: %d)\n"
+                    "  -e, --encoder NAME       encoder backend (default: first available)\n"
+                    "  -o, --encoder-opt K=V    extra encoder option\n"
+                    "encoders:\n", CONVERT_MAX_SCALE, STREAM_MAX_STRIPES, STREAM_PORT, FPS, PACER_MAX_BURST,
+            BITRATE / 1000000, PIU_MAX_BATCH, PIU_DEFAULT_BATCH);
+    encoder_list(stderr);
+    exit(1);
+}
+
+static bool arg_is(const char* arg, const char* long_name, const char* short_name) {
+    return strcmp(arg, long_name) == 0 || strcmp(arg, short_name) == 0;
+}
+
+// Parses a bit rate, with an optional k or M suffix. Returns 0 if invalid.
+static int64_t parse_bitrate(const char* arg) {
+    char* end;
+    double rate = strtod(arg, &end);
+
+    if (*end == 'k')
+        rate *= 1000, end++;
+    else if (*end == 'M')
+        rate *= 1000000, end++;
+
+    return *end == '\0' && rate >= RATE_MIN_BITRATE ? (int64_t)rate : 0;
+}
+
+static void write_packet(void* opaque, const stripe_t* stripe, const AVPacket* pkt);
+
+// Frame size of the image shrunk scale times. Subsampled chroma crops an odd
+// last row or column.
+static void scaled_size(const XImage* image, int scale, enum AVPixelFormat format, int* width, int* height) {
+    *width = image->width / scale;
+    *height = image->height / scale;
+
+    if (format == AV_PIX_FMT_NV12 || format == AV_PIX_FMT_YUV420P) {
+        *width &= ~1;
+        *height &= ~1;
+    }
+}
+
+// Opens the stripe encoders, and returns the context describing the whole
+// frame, which is not opened itself. Returns NULL if the encoder is not
+// available or cannot be opened, so the caller can fall back to the next
+// backend.
+static AVCodecContext* open_encoder(const encoder_t* enc, const XImage* image, int scale, int stripes,
+                                    const AVDictionary* opts) {
+    const AVCodec *codec = avcodec_find_encoder_by_name(enc->codec_name);
+    if (!codec) {
+        fprintf(stderr, "scp: encoder %s not available\n", enc->codec_name);
+        return NULL;
+    }
+
+    AVCodecContext *c = avcodec_alloc_context3(codec);
+    if (!c) {
+        die("failed to allocate video codec context\n");
+    }
+
+    c->time_base = (AVRational){1, pipeline.fps};
+    c->framerate = (AVRational){pipeline.fps, 1};
+    c->slices = pipeline.slices;
+    c->bit_rate = pipeline.bitrate;
+
+    // The refresh column sweeps the frame once per GOP, so a lost packet
+    // heals within a second even without a keyframe request
+    AVDictionary* stripe_opts = NULL;
+    av_dict_copy(&stripe_opts, opts, 0);
+    if (pipeline.intra_refresh) {
+        if (!enc->intra_refresh) {
+            fprintf(stderr, "scp: encoder %s has no intra refresh\n", enc->codec_name);
+            avcodec_free_context(&c);
+            av_dict_free(&stripe_opts);
+            return NULL;
+        }
+        c->gop_size = pipeline.fps;
+        for (const char* const* o = enc->intra_refresh; *o != NULL; o += 2)
+            av_dict_set(&stripe_opts, o[0], o[1], AV_DICT_DONT_OVERWRITE);
+    }
+
+    // A backend ignoring regions of interest is skipped, so that without -e
+    // the fallback picks one that applies them
+    if (pipeline.roi) {
+        if (!enc->roi) {
+            fprintf(stderr, "scp: encoder %s ignores regions of interest\n", enc->codec_name);
+            avcodec_free_context(&c);
+            av_dict_free(&stripe_opts);
+            return NULL;
+        }
+        for (const char* const* o = enc->roi; *o != NULL; o += 2)
+            av_dict_set(&stripe_opts, o[0], o[1], AV_DICT_DONT_OVERWRITE);
+    }
+
+    c->pix_fmt = convert_negotiate(image, codec->pix_fmts);
+    if (c->pix_fmt == AV_PIX_FMT_NONE) {
+        fprintf(stderr, "scp: encoder %s accepts no supported pixel format\n", enc->codec_name);
+        avcodec_free_context(&c);
+        av_dict_free(&stripe_opts);
+        return NULL;
+    }
+
+    scaled_size(image, scale, c->pix_fmt, &c->width, &c->height);
+    if (c->pix_fmt == AV_PIX_FMT_NV12 || c->pix_fmt == AV_PIX_FMT_YUV420P) {
+        c->colorspace = AVCOL_SPC_BT709;
+        c->color_primaries = AVCOL_PRI_BT709;
+        c->color_trc = AVCOL_TRC_BT709;
+        c->color_range = AVCOL_RANGE_MPEG;
+    }
+
+    int err = stripes_open(&pipeline.stripes, enc, c, stripes, stripe_opts, write_packet, NULL);
+    if (err < 0) {
+        fprintf(stderr, "scp: failed to open %s: %s\n", enc->codec_name, av_err2str(err));
+        avcodec_free_context(&c);
+        av_dict_free(&stripe_opts);
+        return NULL;
+    }
+
+    pipeline.stripe_opts = stripe_opts;
+    return c;
+}
+
+// Reopens the stripe encoders for frames of another size. They start over
+// with a keyframe, and the player follows the new size.
+static void reopen_encoder(const encoder_t* enc, AVCodecContext* c, const AVFrame* frame) {
+    int count = pipeline.stripes.count;
+    stripes_close(&pipeline.stripes);
+
+    c->width = frame->width;
+    c->height = frame->height;
+    int err = stripes_open(&pipeline.stripes, enc, c, count, pipeline.stripe_opts, write_packet, NULL);
+    if (err < 0) {
+        die("scp: failed to reopen %s at %dx%d: %s\n", enc->codec_name, c->width, c->height, av_err2str(err));
+    }
+}
+
+// Applies the decisions of the rate controller. The bitrate changes between
+// two frames, the frame rate at the next tick, and the scale at the next
+// converted frame.
+static void apply_rate(const rate_state_t* s, AVCodecContext* c) {
+    if (s->bitrate != c->bit_rate) {
+        c->bit_rate = s->bitrate;
+        stripes_set_bitrate(&pipeline.stripes, s->bitrate);
+    }
+    atomic_store(&pipeline.fps_divisor, s->divisor);
+    atomic_store(&pipeline.scale, s->scale);
+}
+
+// Packets are sent to the player as access units. On stdout, they are written
+// behind their header if framed, or as a raw bitstream.
+static void write_packet(void* opaque, const stripe_t* stripe, const AVPacket* pkt) {
+    if (pkt->flags & AV_PKT_FLAG_KEY)
+        pipeline.refresh_tiles = true;
+
+    stream_header_t h = {
+        .codec = stripe->c->codec_id,
+        .pts = pkt->pts,
+        .size = pkt->size,
+        .width = pipeline.stripes.width,
+        .height = pipeline.stripes.height,
+        .y = stripe->y,
+        .rows = stripe->rows,
+        .index = stripe->index,
+        .count = pipeline.stripes.count,
+        .flags = pkt->flags & AV_PKT_FLAG_KEY ? STREAM_FLAG_KEY : 0,
+        .fps = pipeline.fps <= UINT8_MAX ? pipeline.fps : 0,
+    };
+
+    if (pipeline.peer != NULL) {
+        // The player cannot decode the stripe past a lost packet
+        if (!stream_send(pipeline.peer, &h, pkt->data)) {
+            fprintf(stderr, "scp: failed to send a packet\n");
+            stripes_request_key(&pipeline.stripes, stripe->index);
+        }
+        return;
+    }
+
+    if (pipeline.framed) {
+        uint8_t header[STREAM_HEADER_SIZE];
+        stream_header_pack(&h, header);
+        write(STDOUT_FILENO, header, sizeof header);
+    }
+
+    write(STDOUT_FILENO, pkt->data, pkt->size);
+}
+
+// Picture loss indications from the player: the stripe gets a keyframe, so it
+// recovers within a round-trip instead of at the next GOP.
+static void* feedback_thread(void* arg) {
+    stream_feedback_t fb;
+
+    for (;;) {
+        stream_recv_feedback(pipeline.peer, &fb);
+        if (fb.type != STREAM_FEEDBACK_PLI)
+            continue;
+
+        if (fb.index == STREAM_ALL_STRIPES)
+            fprintf(stderr, "scp: player lost a picture at pts %lld\n", (long long)fb.pts);
+        else
+            fprintf(stderr, "scp: player lost stripe %d at pts %lld\n", fb.index, (long long)fb.pts);
+        stripes_request_key(&pipeline.stripes, fb.index);
+    }
+    return NULL;
+}
+
+// Points a frame at the shm memory of the capture, so the encoder reads it
+// without any copy. The frame gets a buffer reference per use, see
+// capture_ref().
+static void capture_wrap(capture_t* cap, const AVCodecContext* c) {
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) {
+        die("failed to alloc frame");
+    }
+
+    frame->format = c->pix_fmt;
+    frame->width = c->width;
+    frame->height = c->height;
+
+    frame->data[0] = (uint8_t*)cap->image->data;
+    frame->linesize[0] = cap->image->bytes_per_line;
+
+    cap->frame = frame;
+}
+
+// Encoders may keep a reference to their input past send and receive, so the
+// capture is only released by shm_buffer_free(), when the last one is gone.
+static void capture_ref(capture_t* cap) {
+    cap->frame->buf[0] = av_buffer_create(cap->frame->data[0], cap->image->bytes_per_line * cap->image->height,
+            shm_buffer_free, cap, 0);
+    if (!cap->frame->buf[0]) {
+        die("failed to wrap shm buffer\n");
+    }
+    atomic_fetch_add(&captures_held, 1);
+}
+
+// Without damage tracking, every tick captures the full screen. With it,
+// idle ticks are skipped, except for one keep-alive frame every
+// KEEPALIVE_SECONDS, and only changed rows are grabbed. The tick is the pts,
+// so skipped ticks leave gaps in the stream timing rather than shifting it.
+static void* capture_thread(void* arg) {
+    pacer_t pacer;
+    pacer_init(&pacer, pipeline.fps, pipeline.late_policy);
+
+    int64_t keepalive = KEEPALIVE_SECONDS * pipeline.fps;
+    int64_t last = -keepalive;
+    uint64_t seq = 0;
+    do {
+        int64_t tick = pacer_wait(&pacer);
+
+        // Damage is only polled on ticks that may capture, so none is lost
+        bool due = tick % atomic_load(&pipeline.fps_divisor) == 0;
+
+        damage_t delta;
+        bool changed = due && capture_poll(&pipeline.source, &delta);
+
+        if (due && (changed || tick - last >= keepalive)) {
+            capture_t* cap = frame_ring_acquire(&pipeline.capture_ring);
+            capture_request(&pipeline.source, cap);
+
+            cap->delta = delta;
+            cap->pts = tick;
+            cap->seq = seq++;
+            frame_ring_publish(&pipeline.capture_ring, cap);
+
+            last = tick;
+        }
+
+        if (pacer.stats.ticks == (unsigned long)REPORT_SECONDS * pipeline.fps) {
+            pacer_stats_t st = pacer_stats(&pacer);
+            fprintf(stderr, "scp: capture jitter avg %lld us, max %lld us, %lu ticks late\n",
+                    st.late_sum / (long long)st.ticks / 1000, st.late_max / 1000, st.skipped);
+        }
+    } while (1);
+
+    return NULL;
+}
+
+// Completes a capture on the consumer side: waits for its rows, and rehashes
+// the tiles they touched.
+static void capture_finish(capture_t* cap) {
+    capture_wait(&pipeline.source, cap);
+
+    if (pipeline.roi)
+        tiles_hash(&pipeline.grid, cap->image, &cap->grabbed, pipeline.captures_tiles[cap - pipeline.captures]);
+    damage_clear(&cap->grabbed);
+}
+
+// Each frame keeps the rows that changed since it was last written, so only
+// those are converted. A gap in the capture sequence (a dropped capture)
+// loses its damage, and refreshes everything.
+static void* convert_thread(void* arg) {
+    const capture_source_t* src = &pipeline.source;
+    uint64_t seq = 0;
+
+    do {
+        capture_t* cap = frame_ring_take(&pipeline.capture_ring);
+
+        for (int i = 0; i < RING_DEPTH + 2; i++) {
+            if (cap->seq != seq)
+                damage_fill(&pipeline.frames_info[i].stale, src->width, src->height);
+            else
+                damage_merge(&pipeline.frames_info[i].stale, &cap->delta);
+        }
+        seq = cap->seq + 1;
+
+        int scale = atomic_load(&pipeline.scale);
+        if (scale != pipeline.cv.scale && !convert_set_scale(&pipeline.cv, cap->image, scale)) {
+            die("failed to setup downscaling by %d\n", scale);
+        }
+
+        AVFrame* frame = frame_ring_acquire(&pipeline.frame_ring);
+        frame_info_t* info = frame->opaque;
+        damage_t* stale = &info->stale;
+
+        // Frames of the previous scale are reallocated as they come around
+        int width, height;
+        scaled_size(cap->image, pipeline.cv.scale, pipeline.cv.dst, &width, &height);
+        if (frame->width != width || frame->height != height) {
+            av_frame_unref(frame);
+            frame->format = pipeline.cv.dst;
+            frame->width = width;
+            frame->height = height;
+            if (av_frame_get_buffer(frame, 0) < 0) {
+                die("failed to allocate frame buffer");
+            }
+            frame->opaque = info;
+            damage_fill(stale, src->width, src->height);
+        }
+
+        // A reallocated buffer has lost its contents
+        uint8_t* data = frame->data[0];
+        if (av_frame_make_writable(frame) < 0) {
+            die("failed to make frame writable\n");
+        }
+        if (frame->data[0] != data)
+            damage_fill(stale, src->width, src->height);
+
+        capture_finish(cap);
+
+        int y = 0, end;
+        while (damage_next_rows(stale, src->height, &y, &end)) {
+            convert_rows(&pipeline.cv, frame, cap->image, y, end);
+            y = end;
+        }
+        damage_clear(stale);
+
+        if (pipeline.roi)
+            memcpy(info->tiles, pipeline.captures_tiles[cap - pipeline.captures],
+                   tile_count(&pipeline.grid) * sizeof(uint32_t));
+
+        frame->pts = cap->pts;
+
+        frame_ring_release(&pipeline.capture_ring, cap);
+        frame_ring_publish(&pipeline.frame_ring, frame);
+    } while (1);
+
+    return NULL;
+}
+
+// Takes the next frame to encode, and gives it back once sent; a passthrough
+// capture returns to the ring when the encoders drop it. tiles is set to the
+// tile hashes of the frame.
+static AVFrame* encode_take(void** item, const uint32_t** tiles) {
+    if (pipeline.passthrough) {
+        capture_t* cap = frame_ring_take(&pipeline.capture_ring);
+        capture_finish(cap);
+        capture_ref(cap);
+        cap->frame->pts = cap->pts;
+
+        *item = cap;
+        *tiles = pipeline.captures_tiles[cap - pipeline.captures];
+        return cap->frame;
+    }
+
+    AVFrame* frame = frame_ring_take(&pipeline.frame_ring);
+    *item = frame;
+    *tiles = ((frame_info_t*)frame->opaque)->tiles;
+    return frame;
+}
+
+static void encode_release(void* item) {
+    if (!pipeline.passthrough) {
+        frame_ring_release(&pipeline.frame_ring, item);
+        return;
+    }
+
+    capture_t* cap = item;
+    av_buffer_unref(&cap->frame->buf[0]);
+
+    // With every capture held, the capture thread waits for one forever
+    if (atomic_load(&captures_held) == RING_DEPTH + 2) {
+        die("encoder keeps %d input frames, too many for passthrough\n", RING_DEPTH + 2);
+    }
+}
+
 static void stop_loop() {
     piu_stop_loop();
 }
 
 int main(int argc, char* argv[]) {
-    if (argc > 1 && (strcmp(argv[1], "--measure") == 0 || strcmp(argv[1], "-m") == 0))
-        fd = open(FIFO, O_WRONLY);
-    else
-        fd = -1;
+    fd = -1;
+    const char* encoder_name = NULL;
+    AVDictionary* encoder_opts = NULL;
+    bool use_damage = false;
+    bool use_roi = false;
+    Window window = None;
+    XRectangle area, *use_area = NULL;
+    int scale = 1;
+    int stripes = 1;
+    int port = 0;
+    bool framed = false;
+    int64_t bitrate = 0;
+    pipeline.fps = FPS;
+    pipeline.late_policy = PACER_SKIP;
+
+    for (int i = 1; i < argc; i++) {
+        if (arg_is(argv[i], "--measure", "-m")) {
+            fd = open(FIFO, O_WRONLY);
+        } else if (arg_is(argv[i], "--damage", "-d")) {
+            use_damage = true;
+        } else if (arg_is(argv[i], "--roi", "-r")) {
+            use_roi = true;
+        } else if (arg_is(argv[i], "--geometry", "-g") && i + 1 < argc) {
+            unsigned w, h;
+            int x, y, n;
+            if (sscanf(argv[++i], "%ux%u+%d+%d%n", &w, &h, &x, &y, &n) != 4 || argv[i][n] != '\0')
+                usage();
+            area = (XRectangle){x, y, w, h};
+            use_area = &area;
+        } else if (arg_is(argv[i], "--window", "-w") && i + 1 < argc) {
+            char* end;
+            window = strtoul(argv[++i], &end, 0);
+            if (*end != '\0' || window == None)
+                usage();
+        } else if (arg_is(argv[i], "--scale", "-s") && i + 1 < argc) {
+            scale = atoi(argv[++i]);
+            if (scale < 1 || scale > CONVERT_MAX_SCALE)
+                usage();
+        } else if (arg_is(argv[i], "--stripes", "-t") && i + 1 < argc) {
+            stripes = atoi(argv[++i]);
+            if (stripes < 1 || stripes > STREAM_MAX_STRIPES)
+                usage();
+        } else if (arg_is(argv[i], "--framed", "-F")) {
+            framed = true;
+        } else if (arg_is(argv[i], "--port", "-p") && i + 1 < argc) {
+            port = atoi(argv[++i]);
+            if (port <= 0 || port > 65535)
+                usage();
+        } else if (arg_is(argv[i], "--fps", "-f") && i + 1 < argc) {
+            pipeline.fps = atoi(argv[++i]);
+            if (pipeline.fps <= 0)
+                usage();
+        } else if (arg_is(argv[i], "--late", "-l") && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "skip") == 0)
+                pipeline.late_policy = PACER_SKIP;
+            else if (strcmp(argv[i], "catchup") == 0)
+                pipeline.late_policy = PACER_CATCHUP;
+            else
+                usage();
+        } else if (arg_is(argv[i], "--intra-refresh", "-i")) {
+            pipeline.intra_refresh = true;
+        } else if (arg_is(argv[i], "--slices", "-S") && i + 1 < argc) {
+            pipeline.slices = atoi(argv[++i]);
+            if (pipeline.slices < 1)
+                usage();
+        } else if (arg_is(argv[i], "--bitrate", "-b") && i + 1 < argc) {
+            bitrate = parse_bitrate(argv[++i]);
+            if (bitrate == 0)
+                usage();
+        } else if (arg_is(argv[i], "--batch", "-B") && i + 1 < argc) {
+            int batch = atoi(argv[++i]);
+            if (batch < 1 || batch > PIU_MAX_BATCH)
+                usage();
+            piu_set_batch_size(batch);
+        } else if (arg_is(argv[i], "--encoder", "-e") && i + 1 < argc) {
+            encoder_name = argv[++i];
+        } else if (arg_is(argv[i], "--encoder-opt", "-o") && i + 1 < argc) {
+            char* value = strchr(argv[++i], '=');
+            if (value == NULL)
+                usage();
+            *value++ = '\0';
+            av_dict_set(&encoder_opts, argv[i], value, 0);
+        } else {
+            usage();
+        }
+    }
 
     Display *dpy;
     Screen* screen;
 
+    // The capture thread issues requests that the consumer waits for
+    XInitThreads();
     dpy = XOpenDisplay(NULL);
     if (dpy == NULL) {
         die("Cannot open display\n");
@@ -87,152 +653,251 @@ int main(int argc, char* argv[]) {
         XCloseDisplay(dpy) ;
         die("scp: the X server does not support the XSHM extension\n") ;
     }
-    XShmSegmentInfo shminfo;
-
     screen = DefaultScreenOfDisplay(dpy);
 
-    XImage* image = XShmCreateImage(dpy, XDefaultVisualOfScreen(screen), XDefaultDepthOfScreen(screen), ZPixmap,
-            0, &shminfo, screen->width, screen->height);
+    capture_source_init(&pipeline.source, dpy, screen, window, use_area, pipeline.captures, RING_DEPTH + 2,
+                        use_damage);
+
+    void* items[RING_DEPTH + 2];
+    for (int i = 0; i < RING_DEPTH + 2; i++)
+        items[i] = &pipeline.captures[i];
+    XImage* image = pipeline.captures[0].image;
+
+    // With a player, the bitrate adapts below the maximum, and the encoders
+    // are opened at the maximum
+    bool adaptive = port != 0;
+    if (adaptive && bitrate == 0)
+        bitrate = BITRATE;
+    pipeline.bitrate = bitrate;
+    pipeline.roi = use_roi;
+
+    // ffmpeg
+    const encoder_t* enc = NULL;
+    AVCodecContext *c = NULL;
 
-    if (!image) {
-        die("failed to create image");
+    if (encoder_name != NULL) {
+        enc = encoder_find(encoder_name);
+        if (!enc) {
+            die("unknown encoder: %s\n", encoder_name);
+        }
+        c = open_encoder(enc, image, scale, stripes, encoder_opts);
+    } else {
+        for (int i = 0; c == NULL && encoder_auto[i] != NULL; i++) {
+            enc = encoder_auto[i];
+            c = open_encoder(enc, image, scale, stripes, encoder_opts);
+        }
     }
 
-    shminfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
-    if (shminfo.shmid == -1) {
-        die("shmget: %s\n", strerror(errno));
+    if (!c) {
+        die("failed to open an encoder\n");
     }
+    av_dict_free(&encoder_opts);
 
-    shminfo.shmaddr = image->data = shmat(shminfo.shmid, 0, 0);
-    shminfo.readOnly = False;
-    shmctl(shminfo.shmid, IPC_RMID, 0) ;
 
-    if (!XShmAttach(dpy, &shminfo)) {
-        die("failed to attach!\n");
+    if (!convert_setup(&pipeline.cv, image, c->pix_fmt)) {
+        die("failed to setup pixel conversion\n");
+    }
+    if (!convert_set_scale(&pipeline.cv, image, scale)) {
+        die("failed to setup downscaling by %d\n", scale);
+    }
+    pipeline.passthrough = convert_is_passthrough(&pipeline.cv);
+    pipeline.framed = framed || stripes > 1;
+    atomic_init(&pipeline.fps_divisor, 1);
+    atomic_init(&pipeline.scale, scale);
+
+    // Captures are encoded as is in passthrough, otherwise frames may shrink
+    // up to twice more, as long as every stripe keeps some rows
+    int max_scale = scale;
+    if (!pipeline.passthrough) {
+        max_scale = scale * 2 <= CONVERT_MAX_SCALE ? scale * 2 : CONVERT_MAX_SCALE;
+        while (max_scale > scale && image->height / max_scale <= STRIPE_ALIGN * stripes * stripes)
+            max_scale--;
     }
 
-    struct timespec frame_timespec = {
-        .tv_sec = 0,
-        .tv_nsec = NANOSECS_PER_FRAME,
-    };
+    if (use_roi) {
+        if (!tile_grid_init(&pipeline.grid, image->width, image->height)) {
+            die("failed to create tile grid\n");
+        }
 
-    // ffmpeg
-    AVCodec *codec = avcodec_find_encoder_by_name(CODEC_NAME);
-    if (!codec) {
-        die("failed to find encoder %s\n", CODEC_NAME);
+        for (int i = 0; i < RING_DEPTH + 2; i++) {
+            pipeline.captures_tiles[i] = calloc(tile_count(&pipeline.grid), sizeof(uint32_t));
+            pipeline.frames_info[i].tiles = calloc(tile_count(&pipeline.grid), sizeof(uint32_t));
+            if (!pipeline.captures_tiles[i] || !pipeline.frames_info[i].tiles) {
+                die("failed to allocate tile hashes\n");
+            }
+        }
     }
 
-    AVCodecContext *c = avcodec_alloc_context3(codec);
-    if (!c) {
-        die("failed to allocate video codec context\n");
+    if (!frame_ring_init(&pipeline.capture_ring, items, RING_DEPTH + 2)) {
+        die("failed to create capture ring\n");
     }
 
-    AVPacket *pkt = av_packet_alloc();
+    if (pipeline.passthrough) {
+        for (int i = 0; i < RING_DEPTH + 2; i++)
+            capture_wrap(&pipeline.captures[i], c);
+    } else {
+        for (int i = 0; i < RING_DEPTH + 2; i++) {
+            AVFrame *frame = av_frame_alloc();
+            if (!frame) {
+                die("failed to alloc frame");
+            }
 
-    c->width = image->width;
-    c->height = image->height;
-    c->time_base = (AVRational){1, FPS};
-    c->framerate = (AVRational){FPS, 1};
+            frame->format = c->pix_fmt;
+            frame->width = c->width;
+            frame->height = c->height;
 
-    c->pix_fmt = AV_PIX_FMT_RGB0;
+            if (av_frame_get_buffer(frame, 0) < 0) {
+                die("failed to allocate frame buffer");
+            }
 
-    int err;
-    err = av_opt_set_int(c->priv_data, "preset", 14, 0);
-    if (err < 0) {
-        die("failed to set option: %s\n", av_err2str(err));
+            frame->opaque = &pipeline.frames_info[i];
+            damage_fill(&pipeline.frames_info[i].stale, image->width, image->height);
+
+            pipeline.frames[i] = frame;
+            items[i] = frame;
+        }
+
+        if (!frame_ring_init(&pipeline.frame_ring, items, RING_DEPTH + 2)) {
+            die("failed to create frame ring\n");
+        }
     }
 
-    // err = av_opt_set_int(c->priv_data, "tune", 4, 0);
-    // if (err < 0) {
-    //     die("failed to set option: %s\n", av_err2str(err));
-    // }
+    long threads = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+    convert_init(threads < 1 ? 1 : threads > CONVERT_MAX_THREADS ? CONVERT_MAX_THREADS : threads);
 
-    c->max_b_frames = 0;
-    err = av_opt_set_int(c->priv_data, "qp", 18, 0);
-    if (err < 0) {
-        die("failed to set option: %s\n", av_err2str(err));
-    } 
+    fprintf(stderr, "scp: encoder: %s, input format: %s (%s), %d stripe(s)\n", enc->name,
+            av_get_pix_fmt_name(c->pix_fmt), pipeline.passthrough ? "passthrough" : convert_impl_name(), stripes);
 
-    err = avcodec_open2(c, codec, NULL);
-    if (err < 0) {
-        die("failed to open codec: %s\n", av_err2str(err));
+    PIUServer* srv = NULL;
+    if (port != 0) {
+        if (!piu_main_loop()) {
+            die("failed to start the piu loop\n");
+        }
+        atexit(stop_loop);
+
+        srv = piu_bind(port);
+        if (!srv) {
+            die("failed to bind port %d\n", port);
+        }
+
+        fprintf(stderr, "scp: waiting for a player on port %d\n", port);
+        while ((pipeline.peer = piu_accept(srv)) == NULL)
+            ;
+        fprintf(stderr, "scp: streaming to %s:%hu\n", piu_socket_addr(pipeline.peer),
+                piu_socket_port(pipeline.peer));
     }
 
-    AVFrame *frame = av_frame_alloc();
-    if (!frame) {
-        die("failed to alloc frame");
+    XSync(dpy, False);
+
+    pthread_t capture_tid, convert_tid;
+    if (pthread_create(&capture_tid, NULL, capture_thread, NULL) != 0) {
+        die("failed to start capture thread\n");
+    }
+    if (!pipeline.passthrough && pthread_create(&convert_tid, NULL, convert_thread, NULL) != 0) {
+        die("failed to start convert thread\n");
+    }
+    pthread_t feedback_tid;
+    if (pipeline.peer != NULL && pthread_create(&feedback_tid, NULL, feedback_thread, NULL) != 0) {
+        die("failed to start feedback thread\n");
     }
 
-    frame->format = c->pix_fmt;
-    frame->width = WIDTH;
-    frame->height = HEIGHT;
+    rate_t rate;
+    if (adaptive) {
+        rate_init(&rate, bitrate, pipeline.fps, image->width, image->height, scale, max_scale, monotonic_clock());
+        apply_rate(&rate.state, c);
+    }
 
-    if (av_frame_get_buffer(frame, 0) < 0) {
-        die("failed to allocate frame buffer");
+    // Tiles against the last encoded frame. After a keyframe, where unchanged
+    // tiles were coded cheaply too, every tile counts as changed once.
+    uint32_t* last_tiles = NULL;
+    uint8_t* changed_tiles = NULL;
+    pipeline.refresh_tiles = true;
+    if (pipeline.roi) {
+        last_tiles = calloc(tile_count(&pipeline.grid), sizeof(uint32_t));
+        changed_tiles = calloc(tile_count(&pipeline.grid), 1);
+        if (!last_tiles || !changed_tiles) {
+            die("failed to allocate tile map\n");
+        }
     }
 
-    XSync(dpy, False);
+    unsigned long dropped = 0;
+    PIUStats sent = {0};
     int i = 0;
     do {
-        struct timespec s, e, elapsed, rem;
-        clock_gettime(CLOCK_MONOTONIC, &s);
-        if (av_frame_make_writable(frame) < 0) {
-            die("failed to make frame writable\n");
-        }
+        void* item;
+        const uint32_t* tiles;
+        AVFrame* frame = encode_take(&item, &tiles);
+
+        if (frame->width != pipeline.stripes.width || frame->height != pipeline.stripes.height)
+            reopen_encoder(enc, c, frame);
 
-        XShmGetImage(dpy, screen->root, image, 0, 0, AllPlanes);
-        XSync(dpy, False);
+        if (pipeline.roi) {
+            tiles_diff(&pipeline.grid, tiles, last_tiles, changed_tiles);
+            if (pipeline.refresh_tiles)
+                memset(changed_tiles, 1, tile_count(&pipeline.grid));
+            pipeline.refresh_tiles = false;
 
-        int size = 0;
-        for (int i = 0; i < 4 * image->width * image->height; i+=4) {
-            frame->data[0][size++] = image->data[i+2];
-            frame->data[0][size++] = image->data[i+1];
-            frame->data[0][size++] = image->data[i+0];
-            frame->data[0][size++] = 0xff;
+            if (!tiles_attach_roi(&pipeline.grid, changed_tiles, frame)) {
+                die("failed to attach regions of interest\n");
+            }
         }
 
         measure_t m;
-        m.pts = i;
+        m.pts = frame->pts;
         m.type = MEASURE_ENCODER;
 
-        frame->pts = i++;
-
         if (fd != -1)
             write(fd, &m, sizeof m);
 
-        if (avcodec_send_frame(c, frame) < 0) {
-            die("failed to send a frame for enconding\n");
+        stripes_encode(&pipeline.stripes, frame);
+        encode_release(item);
+
+        if (adaptive) {
+            PIUStats stats;
+            piu_socket_stats(pipeline.peer, &stats);
+            if (rate_update(&rate, &stats, monotonic_clock()))
+                apply_rate(&rate.state, c);
         }
 
-        int ret = 0;
-        while (ret >= 0) {
-            ret = avcodec_receive_packet(c, pkt);
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-                break;
-            else if (ret < 0){
-                die("error during enconding\n");
+        if (++i % (REPORT_SECONDS * pipeline.fps) == 0) {
+            unsigned long d = atomic_load(&pipeline.capture_ring.dropped) +
+                              (pipeline.passthrough ? 0 : atomic_load(&pipeline.frame_ring.dropped));
+            if (d != dropped)
+                fprintf(stderr, "scp: dropped %lu frames\n", d - dropped);
+            dropped = d;
+
+            if (adaptive)
+                fprintf(stderr, "scp: rate %.2f Mbit/s, %d fps, scale %d, queueing %u ms, loss %.1f%%\n",
+                        rate.state.bitrate / 1e6, pipeline.fps / rate.state.divisor, rate.state.scale,
+                        rate.delay_us / 1000, 100 * rate.loss);
+
+            if (pipeline.peer != NULL) {
+                PIUStats st;
+                piu_socket_stats(pipeline.peer, &st);
+                if (st.send_calls != sent.send_calls)
+                    fprintf(stderr, "scp: %.1f datagrams per send (batch %d%s)\n",
+                            (double)(st.send_datagrams - sent.send_datagrams) / (st.send_calls - sent.send_calls),
+                            st.batch_size, st.gso ? ", gso" : "");
+                sent = st;
             }
-
-            uint8_t* data = pkt->data;
-            int size = pkt->size;
-
-            write(STDOUT_FILENO, data, size);
         }
-
-        clock_gettime(CLOCK_MONOTONIC, &e);
-
-        diff_timespec(&elapsed, &e, &s);
-        diff_timespec(&rem, &frame_timespec, &elapsed);
-
-        nanosleep(&rem, NULL);
     } while(1);
 
-    av_frame_free(&frame);
-    av_packet_free(&pkt);
+    capture_source_free(&pipeline.source);
+    for (int i = 0; i < RING_DEPTH + 2; i++) {
+        av_frame_free(&pipeline.frames[i]);
+        free(pipeline.captures_tiles[i]);
+        free(pipeline.frames_info[i].tiles);
+    }
+    tile_grid_free(&pipeline.grid);
+    convert_free(&pipeline.cv);
+    free(last_tiles);
+    free(changed_tiles);
+    stripes_close(&pipeline.stripes);
+    av_dict_free(&pipeline.stripe_opts);
     avcodec_free_context(&c);
-    // free(data);
-    XDestroyImage(image);
-    shmdt(shminfo.shmaddr);
+    piu_close_socket(pipeline.peer);
+    piu_close_server(srv);
     XCloseDisplay(dpy);
     return 0;
 }
@@ -0,0 +1,201 @@
+#include "stream.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+static uint8_t* put32(uint8_t* p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+    return p + 4;
+}
+
+static uint8_t* put16(uint8_t* p, uint16_t v) {
+    v = htons(v);
+    memcpy(p, &v, 2);
+    return p + 2;
+}
+
+static const uint8_t* get32(const uint8_t* p, uint32_t* v) {
+    memcpy(v, p, 4);
+    *v = ntohl(*v);
+    return p + 4;
+}
+
+static const uint8_t* get16(const uint8_t* p, uint16_t* v) {
+    memcpy(v, p, 2);
+    *v = ntohs(*v);
+    return p + 2;
+}
+
+void stream_header_pack(const stream_header_t* h, uint8_t* buf) {
+    uint8_t* p = buf;
+
+    p = put32(p, STREAM_MAGIC);
+    p = put32(p, h->codec);
+    p = put32(p, (uint64_t)h->pts >> 32);
+    p = put32(p, (uint64_t)h->pts);
+    p = put32(p, h->size);
+    p = put16(p, h->width);
+    p = put16(p, h->height);
+    p = put16(p, h->y);
+    p = put16(p, h->rows);
+    *p++ = h->index;
+    *p++ = h->count;
+    *p++ = h->flags;
+    *p++ = h->fps;
+}
+
+bool stream_header_unpack(stream_header_t* h, const uint8_t* buf) {
+    const uint8_t* p = buf;
+    uint32_t magic, hi, lo;
+
+    p = get32(p, &magic);
+    if (magic != STREAM_MAGIC)
+        return false;
+
+    p = get32(p, &h->codec);
+    p = get32(p, &hi);
+    p = get32(p, &lo);
+    h->pts = (int64_t)((uint64_t)hi << 32 | lo);
+    p = get32(p, &h->size);
+    p = get16(p, &h->width);
+    p = get16(p, &h->height);
+    p = get16(p, &h->y);
+    p = get16(p, &h->rows);
+    h->index = *p++;
+    h->count = *p++;
+    h->flags = *p++;
+    h->fps = *p++;
+
+    return h->count > 0 && h->count <= STREAM_MAX_STRIPES && h->index < h->count &&
+           h->y + h->rows <= h->height;
+}
+
+// Tags a fragment with the access unit it belongs to
+static void fragment_header_pack(const stream_header_t* h, uint16_t index, uint8_t* buf) {
+    uint8_t* p = put32(buf, (uint32_t)h->pts);
+    *p++ = h->index;
+    *p++ = 0;
+    put16(p, index);
+}
+
+bool stream_send(PIUSocket* skt, const stream_header_t* h, const uint8_t* data) {
+    uint8_t header[STREAM_HEADER_SIZE];
+    stream_header_pack(h, header);
+
+    piu_socket_cork(skt, true);
+    bool sent = piu_send(skt, header, sizeof header);
+
+    uint32_t offset = 0;
+    for (uint16_t i = 0; sent && offset < h->size; i++) {
+        uint32_t size = h->size - offset < STREAM_FRAGMENT_SIZE ? h->size - offset : STREAM_FRAGMENT_SIZE;
+
+        uint8_t fragment[STREAM_FRAGMENT_HEADER_SIZE];
+        fragment_header_pack(h, i, fragment);
+
+        struct iovec iov[] = {
+            {fragment, sizeof fragment},
+            {(void*)(data + offset), size},
+        };
+        sent = piu_sendv(skt, iov, 2);
+        offset += size;
+    }
+
+    piu_socket_cork(skt, false);
+    return sent;
+}
+
+void stream_reader_init(stream_reader_t* r, PIUSocket* skt) {
+    r->skt = skt;
+    r->pending = false;
+}
+
+void stream_recv_header(stream_reader_t* r, stream_header_t* h) {
+    if (r->pending) {
+        r->pending = false;
+        if (stream_header_unpack(h, r->header))
+            return;
+    }
+
+    // Anything else than a header (fragments of a cut access unit) is
+    // skipped; the spill byte tells headers from longer messages.
+    for (;;) {
+        uint8_t spill;
+        struct iovec iov[] = {
+            {r->header, sizeof r->header},
+            {&spill, 1},
+        };
+        int n = piu_recvv(r->skt, iov, 2);
+        if (n == sizeof r->header && stream_header_unpack(h, r->header))
+            return;
+    }
+}
+
+stream_status_t stream_recv_payload(stream_reader_t* r, const stream_header_t* h, uint8_t* data) {
+    uint32_t offset = 0;
+    for (uint16_t i = 0; offset < h->size; i++) {
+        uint32_t size = h->size - offset < STREAM_FRAGMENT_SIZE ? h->size - offset : STREAM_FRAGMENT_SIZE;
+
+        uint8_t fragment[STREAM_FRAGMENT_HEADER_SIZE], expected[STREAM_FRAGMENT_HEADER_SIZE];
+        uint8_t spill[STREAM_HEADER_SIZE];
+        fragment_header_pack(h, i, expected);
+
+        struct iovec iov[] = {
+            {fragment, sizeof fragment},
+            {data + offset, size},
+            {spill, sizeof spill},
+        };
+        int n = piu_recvv(r->skt, iov, 3);
+        if (n == (int)(sizeof fragment + size) && memcmp(fragment, expected, sizeof fragment) == 0) {
+            offset += size;
+            continue;
+        }
+
+        // Put the message back together, in case it is the next header
+        if (n == STREAM_HEADER_SIZE) {
+            uint32_t in_data = n - sizeof fragment < size ? n - sizeof fragment : size;
+            memcpy(r->header, fragment, sizeof fragment);
+            memcpy(r->header + sizeof fragment, data + offset, in_data);
+            memcpy(r->header + sizeof fragment + in_data, spill, n - sizeof fragment - in_data);
+            r->pending = true;
+        }
+        return STREAM_CUT;
+    }
+    return STREAM_OK;
+}
+
+bool stream_send_feedback(PIUSocket* skt, const stream_feedback_t* fb) {
+    uint8_t buf[STREAM_FEEDBACK_SIZE];
+    uint8_t* p = buf;
+
+    p = put32(p, STREAM_FEEDBACK_MAGIC);
+    *p++ = fb->type;
+    *p++ = fb->index;
+    p = put16(p, 0);
+    p = put32(p, (uint64_t)fb->pts >> 32);
+    put32(p, (uint64_t)fb->pts);
+
+    return piu_send(skt, buf, sizeof buf);
+}
+
+void stream_recv_feedback(PIUSocket* skt, stream_feedback_t* fb) {
+    uint8_t buf[STREAM_FEEDBACK_SIZE];
+
+    for (;;) {
+        int n = piu_recv(skt, buf, sizeof buf);
+
+        const uint8_t* p = buf;
+        uint32_t magic, hi, lo;
+        p = get32(p, &magic);
+        if (n != sizeof buf || magic != STREAM_FEEDBACK_MAGIC)
+            continue;
+
+        fb->type = *p++;
+        fb->index = *p++;
+        p += 2;
+        p = get32(p, &hi);
+        get32(p, &lo);
+        fb->pts = (int64_t)((uint64_t)hi << 32 | lo);
+        return;
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef _SCP_STREAM_H
+#define _SCP_STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "piu/PIUSocket.h"
+
+#define STREAM_MAGIC 0x53435053 // "SCPS"
+#define STREAM_FEEDBACK_MAGIC 0x53435046 // "SCPF"
+#define STREAM_HEADER_SIZE 32
+#define STREAM_MAX_STRIPES 16
+
+#define STREAM_FLAG_KEY 0x01
+
+#define STREAM_FEEDBACK_SIZE 16
+#define STREAM_ALL_STRIPES 0xff
+
+#define STREAM_PORT 5959
+
+// Over piu, payloads are cut so every datagram is a full piu segment, which
+// fits in one Ethernet frame and lets piu send the fragments of a payload as
+// one buffer
+#define STREAM_FRAGMENT_HEADER_SIZE 8
+#define STREAM_FRAGMENT_SIZE (PIU_SEGMENT_BYTES - PIU_HEADER_BYTES - STREAM_FRAGMENT_HEADER_SIZE)
+
+// Header of every packet of a striped stream: the frame is split in count
+// horizontal stripes, each coded on its own, and the player puts stripe index
+// back at rows [y, y + rows). Sent in network byte order, followed by size
+// bytes of payload.
+typedef struct {
+    uint32_t codec; // AVCodecID
+    int64_t pts;
+    uint32_t size;
+
+    uint16_t width, height; // Whole frame
+    uint16_t y, rows;
+    uint8_t index, count;
+    uint8_t flags;
+    uint8_t fps; // pts are in 1/fps, 0 if unknown (over 255)
+} stream_header_t;
+
+void stream_header_pack(const stream_header_t* h, uint8_t* buf);
+
+// Returns false if buf does not hold a valid header.
+bool stream_header_unpack(stream_header_t* h, const uint8_t* buf);
+
+// An access unit over piu: one message with the header, then the payload in
+// STREAM_FRAGMENT_SIZE fragments, each behind a fragment header naming the
+// access unit and the fragment index. piu delivers in order, so fragments
+// are read straight into their place in the payload. The socket is corked
+// meanwhile, so the fragments go out in batches.
+bool stream_send(PIUSocket* skt, const stream_header_t* h, const uint8_t* data);
+
+// Receiving end. An access unit is cut short when scp fails to send part of
+// it; the header read in place of the missing fragment is then kept for the
+// next stream_recv_header(), and stray fragments are skipped.
+typedef struct {
+    PIUSocket* skt;
+    bool pending;
+    uint8_t header[STREAM_HEADER_SIZE];
+} stream_reader_t;
+
+typedef enum {
+    STREAM_OK,
+    STREAM_CUT,    // The access unit is incomplete, and must be dropped
+    STREAM_CLOSED, // End of input; piu connections have none
+} stream_status_t;
+
+void stream_reader_init(stream_reader_t* r, PIUSocket* skt);
+
+// Both block until the message they expect: piu has no end of stream, and
+// messages of another size, empty ones included, are skipped (or cut the
+// access unit).
+void stream_recv_header(stream_reader_t* r, stream_header_t* h);
+stream_status_t stream_recv_payload(stream_reader_t* r, const stream_header_t* h, uint8_t* data);
+
+// Player to scp, on the same socket
+typedef enum {
+    STREAM_FEEDBACK_PLI = 1, // Picture loss: the stripe needs a keyframe
+} stream_feedback_type_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t index; // Stripe, or STREAM_ALL_STRIPES
+    int64_t pts;   // Of the frame the loss was noticed in
+} stream_feedback_t;
+
+bool stream_send_feedback(PIUSocket* skt, const stream_feedback_t* fb);
+void stream_recv_feedback(PIUSocket* skt, stream_feedback_t* fb);
+
+#endif
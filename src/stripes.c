@@ -0,0 +1,268 @@
+#include "stripes.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libavutil/pixdesc.h>
+
+static void die(const char *errstr, ...) {
+    va_list ap;
+
+    va_start(ap, errstr);
+    vfprintf(stderr, errstr, ap);
+    va_end(ap);
+    exit(1);
+}
+
+// Stripes share the bit rate by rows, with a VBV buffer of one frame so no
+// frame takes longer than a frame interval to send.
+static void stripe_rate(stripe_t* st, int64_t bitrate, int height) {
+    AVCodecContext* c = st->c;
+
+    c->bit_rate = bitrate * st->rows / height;
+    c->rc_max_rate = c->bit_rate;
+    c->rc_buffer_size = c->bit_rate * c->time_base.num / c->time_base.den;
+}
+
+static void close_stripe(stripe_t* st) {
+    avcodec_free_context(&st->c);
+    av_frame_free(&st->view);
+    av_packet_free(&st->pkt);
+}
+
+static int open_stripe(stripe_t* st, const encoder_t* enc, const AVCodecContext* c, int threads,
+                       const AVDictionary* opts) {
+    st->c = avcodec_alloc_context3(c->codec);
+    st->view = av_frame_alloc();
+    st->pkt = av_packet_alloc();
+    if (!st->c || !st->view || !st->pkt)
+        return AVERROR(ENOMEM);
+
+    st->c->width = c->width;
+    st->c->height = st->rows;
+    st->c->pix_fmt = c->pix_fmt;
+    st->c->gop_size = c->gop_size;
+    st->c->slices = c->slices;
+    st->c->time_base = c->time_base;
+    st->c->framerate = c->framerate;
+    st->c->colorspace = c->colorspace;
+    st->c->color_primaries = c->color_primaries;
+    st->c->color_trc = c->color_trc;
+    st->c->color_range = c->color_range;
+    if (c->bit_rate > 0)
+        stripe_rate(st, c->bit_rate, c->height);
+
+    return encoder_open(enc, st->c, threads, opts);
+}
+
+// Points view at rows [y, y + rows) of frame, without copying.
+static void stripe_view(const stripe_t* st, AVFrame* frame) {
+    AVFrame* view = st->view;
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+
+    if (av_frame_ref(view, frame) < 0) {
+        die("stripes: failed to reference frame\n");
+    }
+
+    view->height = st->rows;
+    for (int p = 0; p < AV_NUM_DATA_POINTERS && view->data[p]; p++) {
+        int shift = p > 0 ? desc->log2_chroma_h : 0;
+        view->data[p] += (ptrdiff_t)(st->y >> shift) * view->linesize[p];
+    }
+
+    // Side data buffers are shared with the frame, so regions are rebuilt
+    AVFrameSideData* sd = av_frame_get_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    av_frame_remove_side_data(view, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if (!sd)
+        return;
+
+    const AVRegionOfInterest* roi = (const AVRegionOfInterest*)sd->data;
+    int n = sd->size / roi->self_size, count = 0;
+    for (int i = 0; i < n; i++) {
+        if (roi[i].bottom > st->y && roi[i].top < st->y + st->rows)
+            count++;
+    }
+    if (count == 0)
+        return;
+
+    AVFrameSideData* vsd = av_frame_new_side_data(view, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                                  count * sizeof(AVRegionOfInterest));
+    if (!vsd) {
+        die("stripes: failed to allocate regions of interest\n");
+    }
+
+    AVRegionOfInterest* out = (AVRegionOfInterest*)vsd->data;
+    for (int i = 0; i < n; i++) {
+        if (roi[i].bottom <= st->y || roi[i].top >= st->y + st->rows)
+            continue;
+
+        *out = roi[i];
+        out->self_size = sizeof(AVRegionOfInterest);
+        out->top = roi[i].top > st->y ? roi[i].top - st->y : 0;
+        out->bottom = roi[i].bottom < st->y + st->rows ? roi[i].bottom - st->y : st->rows;
+        out++;
+    }
+}
+
+static void encode_stripe(stripes_t* s, stripe_t* st) {
+    stripe_view(st, s->frame);
+
+    // Encoders are opened with forced-idr, so this is an IDR and not just an
+    // intra frame that later frames could reference past
+    unsigned bit = 1u << st->index;
+    if (atomic_fetch_and(&s->force_key, ~bit) & bit)
+        st->view->pict_type = AV_PICTURE_TYPE_I;
+
+    if (avcodec_send_frame(st->c, st->view) < 0) {
+        die("failed to send a frame for enconding\n");
+    }
+    av_frame_unref(st->view);
+
+    int ret = 0;
+    while (ret >= 0) {
+        ret = avcodec_receive_packet(st->c, st->pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            break;
+        else if (ret < 0) {
+            die("error during enconding\n");
+        }
+
+        pthread_mutex_lock(&s->lock);
+        s->output(s->opaque, st, st->pkt);
+        pthread_mutex_unlock(&s->lock);
+
+        av_packet_unref(st->pkt);
+    }
+}
+
+static void* stripe_worker(void* arg) {
+    stripe_t* st = arg;
+    stripes_t* s = st->set;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->generation == seen && !s->quit)
+            pthread_cond_wait(&s->start, &s->lock);
+        if (s->quit)
+            break;
+        seen = s->generation;
+        pthread_mutex_unlock(&s->lock);
+
+        encode_stripe(s, st);
+
+        pthread_mutex_lock(&s->lock);
+        if (--s->pending == 0)
+            pthread_cond_signal(&s->done);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+int stripes_open(stripes_t* s, const encoder_t* enc, const AVCodecContext* c, int count,
+                 const AVDictionary* opts, stripes_output_fn output, void* opaque) {
+    if (count < 1 || count > STREAM_MAX_STRIPES)
+        return AVERROR(EINVAL);
+
+    int rows = (c->height / count + STRIPE_ALIGN - 1) / STRIPE_ALIGN * STRIPE_ALIGN;
+    if (rows * (count - 1) >= c->height)
+        return AVERROR(EINVAL);
+
+    // A single stripe keeps the encoder own threading
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = count == 1 ? 0 : cores / count > 1 ? cores / count : 1;
+
+    // Not the key requests, which may come in while the set is closed
+    memset(s->stripes, 0, sizeof s->stripes);
+    s->width = c->width;
+    s->height = c->height;
+    s->output = output;
+    s->opaque = opaque;
+    s->generation = 0;
+    s->pending = 0;
+    s->quit = false;
+    s->frame = NULL;
+
+    for (int i = 0; i < count; i++) {
+        stripe_t* st = &s->stripes[i];
+        st->set = s;
+        st->index = i;
+        st->y = i * rows;
+        st->rows = i + 1 < count ? rows : c->height - st->y;
+
+        int err = open_stripe(st, enc, c, threads, opts);
+        if (err < 0) {
+            for (int j = 0; j <= i; j++)
+                close_stripe(&s->stripes[j]);
+            return err;
+        }
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->start, NULL);
+    pthread_cond_init(&s->done, NULL);
+    atomic_store(&s->count, count);
+
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&s->threads[i], NULL, stripe_worker, &s->stripes[i]) != 0) {
+            die("stripes: failed to start encoder thread\n");
+        }
+    }
+
+    return 0;
+}
+
+void stripes_close(stripes_t* s) {
+    int count = atomic_exchange(&s->count, 0);
+
+    pthread_mutex_lock(&s->lock);
+    s->quit = true;
+    pthread_cond_broadcast(&s->start);
+    pthread_mutex_unlock(&s->lock);
+
+    for (int i = 1; i < count; i++)
+        pthread_join(s->threads[i], NULL);
+
+    for (int i = 0; i < count; i++)
+        close_stripe(&s->stripes[i]);
+
+    pthread_cond_destroy(&s->done);
+    pthread_cond_destroy(&s->start);
+    pthread_mutex_destroy(&s->lock);
+}
+
+void stripes_set_bitrate(stripes_t* s, int64_t bitrate) {
+    for (int i = 0; i < s->count; i++)
+        stripe_rate(&s->stripes[i], bitrate, s->height);
+}
+
+void stripes_request_key(stripes_t* s, int index) {
+    if (index == STREAM_ALL_STRIPES)
+        atomic_fetch_or(&s->force_key, ~0u);
+    else if (index >= 0 && index < atomic_load(&s->count))
+        atomic_fetch_or(&s->force_key, 1u << index);
+}
+
+void stripes_encode(stripes_t* s, AVFrame* frame) {
+    s->frame = frame;
+
+    if (s->count == 1) {
+        encode_stripe(s, &s->stripes[0]);
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->pending = s->count - 1;
+    s->generation++;
+    pthread_cond_broadcast(&s->start);
+    pthread_mutex_unlock(&s->lock);
+
+    encode_stripe(s, &s->stripes[0]);
+
+    pthread_mutex_lock(&s->lock);
+    while (s->pending > 0)
+        pthread_cond_wait(&s->done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
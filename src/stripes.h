@@ -0,0 +1,77 @@
+#ifndef _SCP_STRIPES_H
+#define _SCP_STRIPES_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <libavcodec/avcodec.h>
+
+#include "encoder.h"
+#include "stream.h"
+
+// Stripe rows are a multiple of this, so no macroblock straddles two stripes
+#define STRIPE_ALIGN 16
+
+typedef struct stripes stripes_t;
+
+typedef struct {
+    stripes_t* set;
+    AVCodecContext* c;
+    int index;
+    int y, rows;
+
+    AVFrame* view; // The stripe rows of the frame being encoded
+    AVPacket* pkt;
+} stripe_t;
+
+// Called for every packet, one stripe at a time.
+typedef void (*stripes_output_fn)(void* opaque, const stripe_t* stripe, const AVPacket* pkt);
+
+// Encoders of the horizontal stripes of a frame, each on its own thread;
+// stripe 0 is encoded by the caller.
+struct stripes {
+    stripe_t stripes[STREAM_MAX_STRIPES];
+    atomic_int count; // 0 while closed, read by stripes_request_key()
+    int width, height; // Whole frame
+
+    stripes_output_fn output;
+    void* opaque;
+
+    pthread_t threads[STREAM_MAX_STRIPES];
+    pthread_mutex_t lock; // Also serializes output
+    pthread_cond_t start, done;
+    unsigned generation;
+    int pending;
+    bool quit;
+    AVFrame* frame;
+
+    atomic_uint force_key; // Bit per stripe, see stripes_request_key(); kept on reopen
+};
+
+// Opens count encoders of enc, one per stripe of the frames c describes. c is
+// not opened itself; the stripes take its size, format, timing, color, GOP,
+// slices and bit rate. Returns a negative AVERROR on failure, with nothing
+// left open.
+//
+// s must be zeroed before it is first opened. Once closed, it may be opened
+// again, e.g. at another size, while other threads request keyframes.
+int stripes_open(stripes_t* s, const encoder_t* enc, const AVCodecContext* c, int count,
+                 const AVDictionary* opts, stripes_output_fn output, void* opaque);
+void stripes_close(stripes_t* s);
+
+// Encodes every stripe of the frame and returns once all are sent and their
+// packets are output. Regions of interest of the frame carry over to the
+// stripes they fall in.
+void stripes_encode(stripes_t* s, AVFrame* frame);
+
+// Changes the bit rate of encoders opened with one, between two frames. It is
+// split between stripes by rows. Backends that cannot reconfigure on the fly
+// keep the rate they were opened with.
+void stripes_set_bitrate(stripes_t* s, int64_t bitrate);
+
+// Makes the next frame of the stripe (or every stripe, if index is
+// STREAM_ALL_STRIPES) a keyframe, e.g. after the player lost a picture. May be
+// called from any thread.
+void stripes_request_key(stripes_t* s, int index);
+
+#endif
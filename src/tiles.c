@@ -0,0 +1,146 @@
+#include "tiles.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_LANES 8
+#define HASH_PRIME 0x9e3779b1u
+
+bool tile_grid_init(tile_grid_t* grid, int width, int height) {
+    grid->width = width;
+    grid->height = height;
+    grid->cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+    grid->rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+    grid->marked = malloc(tile_count(grid));
+    return grid->marked != NULL;
+}
+
+void tile_grid_free(tile_grid_t* grid) {
+    free(grid->marked);
+    grid->marked = NULL;
+}
+
+// Multiplicative hash over 32-bit pixels in HASH_LANES independent lanes, so
+// the inner loop vectorizes. Each step is a bijection of the lane state, so a
+// single changed pixel always changes the hash.
+__attribute__((target_clones("avx2", "default")))
+static uint32_t hash_tile(const uint8_t* data, int stride, int width, int height) {
+    uint32_t h[HASH_LANES];
+    for (int k = 0; k < HASH_LANES; k++)
+        h[k] = k + 1;
+
+    for (int y = 0; y < height; y++) {
+        const uint32_t* p = (const uint32_t*)(data + (ptrdiff_t)y * stride);
+
+        int x = 0;
+        for (; x + HASH_LANES <= width; x += HASH_LANES) {
+            for (int k = 0; k < HASH_LANES; k++)
+                h[k] = (h[k] ^ p[x + k]) * HASH_PRIME;
+        }
+        for (; x < width; x++)
+            h[0] = (h[0] ^ p[x]) * HASH_PRIME;
+    }
+
+    uint32_t r = 0;
+    for (int k = 0; k < HASH_LANES; k++) {
+        r = (r ^ h[k]) * 0x85ebca6bu;
+        r ^= r >> 15;
+    }
+    return r;
+}
+
+void tiles_hash(tile_grid_t* grid, const XImage* image, const damage_t* damage, uint32_t* hashes) {
+    uint8_t* marked = grid->marked;
+    memset(marked, 0, tile_count(grid));
+
+    for (int i = 0; i < damage->nrects; i++) {
+        const XRectangle* r = &damage->rects[i];
+        if (r->width == 0 || r->height == 0)
+            continue;
+
+        int c1 = (r->x + r->width - 1) / TILE_SIZE;
+        int r1 = (r->y + r->height - 1) / TILE_SIZE;
+        for (int ty = r->y / TILE_SIZE; ty <= r1 && ty < grid->rows; ty++) {
+            for (int tx = r->x / TILE_SIZE; tx <= c1 && tx < grid->cols; tx++)
+                marked[ty * grid->cols + tx] = 1;
+        }
+    }
+
+    for (int ty = 0; ty < grid->rows; ty++) {
+        for (int tx = 0; tx < grid->cols; tx++) {
+            int t = ty * grid->cols + tx;
+            if (!marked[t])
+                continue;
+
+            int x = tx * TILE_SIZE, y = ty * TILE_SIZE;
+            int w = x + TILE_SIZE <= grid->width ? TILE_SIZE : grid->width - x;
+            int h = y + TILE_SIZE <= grid->height ? TILE_SIZE : grid->height - y;
+
+            const uint8_t* data = (const uint8_t*)image->data + (ptrdiff_t)y * image->bytes_per_line + 4 * x;
+            hashes[t] = hash_tile(data, image->bytes_per_line, w, h);
+        }
+    }
+}
+
+int tiles_diff(const tile_grid_t* grid, const uint32_t* hashes, uint32_t* last, uint8_t* changed) {
+    int n = 0;
+
+    for (int t = 0; t < tile_count(grid); t++) {
+        changed[t] = hashes[t] != last[t];
+        n += changed[t];
+        last[t] = hashes[t];
+    }
+    return n;
+}
+
+bool tiles_attach_roi(const tile_grid_t* grid, const uint8_t* changed, AVFrame* frame) {
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+
+    // One region per run of unchanged tiles in a tile row
+    int count = 0;
+    for (int ty = 0; ty < grid->rows; ty++) {
+        for (int tx = 0; tx < grid->cols; tx++) {
+            int t = ty * grid->cols + tx;
+            if (!changed[t] && (tx == 0 || changed[t - 1]))
+                count++;
+        }
+    }
+
+    if (count == 0)
+        return true;
+
+    AVFrameSideData* sd = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                                 count * sizeof(AVRegionOfInterest));
+    if (sd == NULL)
+        return false;
+
+    AVRegionOfInterest* roi = (AVRegionOfInterest*)sd->data;
+    for (int ty = 0; ty < grid->rows; ty++) {
+        int tx = 0;
+        while (tx < grid->cols) {
+            if (changed[ty * grid->cols + tx]) {
+                tx++;
+                continue;
+            }
+
+            int begin = tx;
+            while (tx < grid->cols && !changed[ty * grid->cols + tx])
+                tx++;
+
+            int top = ty * TILE_SIZE, bottom = (ty + 1) * TILE_SIZE;
+            int left = begin * TILE_SIZE, right = tx * TILE_SIZE;
+
+            roi->self_size = sizeof(AVRegionOfInterest);
+            roi->top = (int64_t)top * frame->height / grid->height;
+            roi->bottom = (int64_t)(bottom < grid->height ? bottom : grid->height) * frame->height / grid->height;
+            roi->left = (int64_t)left * frame->width / grid->width;
+            roi->right = (int64_t)(right < grid->width ? right : grid->width) * frame->width / grid->width;
+            roi->qoffset = TILE_STATIC_QOFFSET;
+            roi++;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef _SCP_TILES_H
+#define _SCP_TILES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <libavutil/frame.h>
+
+#include "capture.h"
+
+#define TILE_SIZE 64
+
+// QP offset of unchanged tiles, in the AVRegionOfInterest scale [-1, 1]
+#define TILE_STATIC_QOFFSET ((AVRational){1, 2})
+
+// Screen split in TILE_SIZE squares. Each buffer keeps a hash per tile, so a
+// change map against the last encoded frame costs one compare per tile.
+typedef struct {
+    int width, height;
+    int cols, rows;
+
+    uint8_t* marked; // Scratch for tiles_hash()
+} tile_grid_t;
+
+bool tile_grid_init(tile_grid_t* grid, int width, int height);
+void tile_grid_free(tile_grid_t* grid);
+
+static inline int tile_count(const tile_grid_t* grid) {
+    return grid->cols * grid->rows;
+}
+
+// Rehashes the tiles of the image touched by the damage. Not reentrant.
+void tiles_hash(tile_grid_t* grid, const XImage* image, const damage_t* damage, uint32_t* hashes);
+
+// Compares hashes against last, marking tiles in changed, and updates last.
+// Returns the number of changed tiles.
+int tiles_diff(const tile_grid_t* grid, const uint32_t* hashes, uint32_t* last, uint8_t* changed);
+
+// Replaces the regions of interest of the frame by the unchanged tiles, with
+// TILE_STATIC_QOFFSET. Coordinates are scaled to the frame size.
+bool tiles_attach_roi(const tile_grid_t* grid, const uint8_t* changed, AVFrame* frame);
+
+#endif